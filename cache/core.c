@@ -22,6 +22,16 @@
  */
 #define CACHE_BUFFER_INITSIZE 4096
 
+/*
+ * Encoded types beyond the Lua types. By default, integers are encoded as
+ * numbers where a number represents them exactly, so that earlier releases
+ * can decode them; only larger integers use the integer type. The integers
+ * encoder uses the integer type for all integers.
+ */
+#define CACHE_TINTEGER (LUA_TNUMBER + 64)
+#define CACHE_TBACKREF (LUA_TTABLE + 64)
+#define CACHE_MAXEXACT ((int64_t) 1 << 53)
+
 /*
  * Backref record.
  */
@@ -109,10 +119,13 @@ static int supported (lua_State *L, int index) {
 }
 
 /*
- * Encodes the value at the specified index.
+ * Encodes the value at the specified index. If integers is set, all integers
+ * are encoded with the integer type.
  */	
-static void encode (lua_State *L, cache_buffer *B, backref_rec *br, int index) {
+static void encode (lua_State *L, cache_buffer *B, backref_rec *br,
+		int integers, int index) {
 	double d;
+	uint64_t i;
 	uint32_t u, nu, narr, nrec;
 	size_t narr_pos, nrec_pos;
 
@@ -124,6 +137,16 @@ static void encode (lua_State *L, cache_buffer *B, backref_rec *br, int index) {
 		break;
 
 	case LUA_TNUMBER:
+		if (lua_isinteger(L, index) && (integers
+				|| lua_tointeger(L, index) > CACHE_MAXEXACT
+				|| lua_tointeger(L, index) < -CACHE_MAXEXACT)) {
+			require(L, B, 1 + sizeof(i));
+			B->b[B->pos++] = (char) CACHE_TINTEGER;
+			i = htobe64((uint64_t) lua_tointeger(L, index));
+			memcpy(&B->b[B->pos], &i, sizeof(i));
+			B->pos += sizeof(i);
+			break;
+		}
 		require(L, B, 1 + sizeof(d));
 		B->b[B->pos++] = (char) LUA_TNUMBER;
 		d = lua_tonumber(L, index);
@@ -158,7 +181,7 @@ static void encode (lua_State *L, cache_buffer *B, backref_rec *br, int index) {
 		} else {
 			/* encode backref */
 			require(L, B, 1 + sizeof(nu));
-			B->b[B->pos++] = (char) LUA_TTABLE + 64;
+			B->b[B->pos++] = (char) CACHE_TBACKREF;
 			u = (uint32_t) lua_tointeger(L, -1);
 			nu = htobe32(u);
 			memcpy(&B->b[B->pos], &nu, sizeof(nu));
@@ -187,8 +210,8 @@ static void encode (lua_State *L, cache_buffer *B, backref_rec *br, int index) {
 				} else {
 					nrec++;
 				}
-				encode(L, B, br, lua_gettop(L) - 1);
-				encode(L, B, br, lua_gettop(L));
+				encode(L, B, br, integers, lua_gettop(L) - 1);
+				encode(L, B, br, integers, lua_gettop(L));
 			}	
 			lua_pop(L, 1);
 		}
@@ -208,6 +231,7 @@ static void encode (lua_State *L, cache_buffer *B, backref_rec *br, int index) {
  */
 static void decode (lua_State *L, cache_buffer *B, backref_rec *br) {
 	double d;
+	uint64_t i;
 	uint32_t nu, u, narr, nrec;
 
 	avail(L, B, 1);
@@ -224,6 +248,13 @@ static void decode (lua_State *L, cache_buffer *B, backref_rec *br) {
 		lua_pushnumber(L, d);
 		break;
 
+	case CACHE_TINTEGER:
+		avail(L, B, sizeof(i));
+		memcpy(&i, &B->b[B->pos], sizeof(i));
+		B->pos += sizeof(i);
+		cache_pushint64(L, (int64_t) be64toh(i));
+		break;
+
 	case LUA_TSTRING:
 		avail(L, B, sizeof(nu));
 		memcpy(&nu, &B->b[B->pos], sizeof(nu));
@@ -261,7 +292,7 @@ static void decode (lua_State *L, cache_buffer *B, backref_rec *br) {
 		}
 		break;	
 
-	case LUA_TTABLE + 64:
+	case CACHE_TBACKREF:
 		/* get backref */
 		avail(L, B, sizeof(nu));
 		memcpy(&nu, &B->b[B->pos], sizeof(nu));
@@ -315,10 +346,9 @@ static const luaL_Reg functions[] = {
 };
 
 /*
- * Exported functions.
+ * Encodes the value at index 1.
  */
-
-int cache_encode (lua_State *L) {
+static int encode_value (lua_State *L, int integers) {
 	backref_rec br;
 	cache_buffer *B;
 
@@ -341,11 +371,23 @@ int cache_encode (lua_State *L) {
 	B->capacity = CACHE_BUFFER_INITSIZE;
 
 	/* encode */
-	encode(L, B, &br, 1);
+	encode(L, B, &br, integers, 1);
 
 	return 1;
 }
 
+/*
+ * Exported functions.
+ */
+
+int cache_encode (lua_State *L) {
+	return encode_value(L, 0);
+}
+
+int cache_encode_integers (lua_State *L) {
+	return encode_value(L, 1);
+}
+
 int cache_decode (lua_State *L) {
 	cache_buffer *B;
 	backref_rec br;
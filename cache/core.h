@@ -7,6 +7,17 @@
 
 #include <lua.h>
 
+/*
+ * Lua 5.3 integer compatibility. Before Lua 5.3, integers are pushed as
+ * numbers, which represent integers exactly up to 2^53.
+ */
+#if LUA_VERSION_NUM < 503
+#define lua_isinteger(L, i) 0
+#define cache_pushint64(L, n) lua_pushnumber((L), (lua_Number) (n))
+#else
+#define cache_pushint64(L, n) lua_pushinteger((L), (lua_Integer) (n))
+#endif
+
 /* cache fields */
 #define CACHE_FDRIVER "driver"
 #define CACHE_FMAP "map"
@@ -44,6 +55,16 @@ typedef struct cache_buffer {
  */ 
 int cache_encode (lua_State *L);
 
+/*
+ * Encodes a value, using the integer type for all integers. Such values
+ * cannot be decoded by earlier releases. The function raises a Lua error if
+ * the encoding fails.
+ *
+ * @param L the Lua state
+ * @return the number of results
+ */
+int cache_encode_integers (lua_State *L);
+
 /*
  * Decodes a value. The function raises a Lua error if the decoding fails.
  *
@@ -7,7 +7,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
@@ -16,6 +17,7 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include "core.h"
+#include "pool.h"
 #include "memcached.h"
 
 /*
@@ -29,6 +31,7 @@
  * Memcached parameters.
  */
 #define CACHE_MEMCACHED_METATABLE "cache_memcached"
+#define CACHE_MEMCACHED_EXCHANGE_METATABLE "cache_memcached_exchange"
 
 /*
  * Response parts.
@@ -42,6 +45,40 @@
  */
 #define CACHE_MEMCACHED_STRING 1
 
+/*
+ * Exchange operations.
+ */
+#define CACHE_MEMCACHED_OGET 1
+#define CACHE_MEMCACHED_OSET 2
+#define CACHE_MEMCACHED_OINCREMENT 3
+#define CACHE_MEMCACHED_OFLUSH 4
+#define CACHE_MEMCACHED_OSTAT 5
+
+/*
+ * Exchange buffer size.
+ */
+#define CACHE_MEMCACHED_BUFSIZE 4096
+
+/*
+ * Request and response exchange. Each operation has its own exchange, which
+ * holds the socket while the exchange is pending.
+ */
+typedef struct memcached_exchange {
+	int fd;
+	int op;
+	char *key;
+	char *out;
+	size_t out_len;
+	size_t out_pos;
+	size_t out_capacity;
+	char *in;
+	size_t in_len;
+	size_t in_capacity;
+	size_t in_scan;
+	size_t in_need;
+	size_t in_pos;
+} memcached_exchange;
+
 /*
  * Cache record.
  */
@@ -50,8 +87,33 @@ typedef struct memcached_rec {
 	int encode_index;
 	int decode_index;
 	int sockets_index;
+	int wait_index;
+	int pool;
 } memcached_rec;
 
+/*
+ * Key identifying pending exchanges.
+ */
+static char pending_key;
+
+/*
+ * Wraps the memcached functions. A wrapped function that returns the pending
+ * key waits with the returned function for the socket and then continues the
+ * exchange. The wait happens in Lua, so it may yield the running coroutine.
+ */
+static const char wrap_chunk[] =
+		"local pending, continue = ...\n"
+		"return function (f)\n"
+		"	return function (...)\n"
+		"		local r, wait, fd, events, x = f(...)\n"
+		"		while r == pending do\n"
+		"			wait(fd, events)\n"
+		"			r, wait, fd, events, x = continue((...), x)\n"
+		"		end\n"
+		"		return r\n"
+		"	end\n"
+		"end\n";
+
 /*
  * Returns a string field.
  */
@@ -79,6 +141,7 @@ static int map (lua_State *L) {
  */
 static int configure (lua_State *L) {
 	memcached_rec *m;
+	int integers;
 
 	luaL_checktype(L, 1, LUA_TTABLE);
 
@@ -90,12 +153,29 @@ static int configure (lua_State *L) {
 
 	/* set functions */
 	m->map_index = get_function(L, 1, CACHE_FMAP, map);
-	m->encode_index = get_function(L, 1, CACHE_FENCODE, cache_encode);
+	lua_getfield(L, 1, "integers");
+	integers = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	m->encode_index = get_function(L, 1, CACHE_FENCODE, integers
+			? cache_encode_integers : cache_encode);
 	m->decode_index = get_function(L, 1, CACHE_FDECODE, cache_decode);
 
 	/* set servers table */
 	lua_newtable(L);
 	m->sockets_index = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	/* set pool flag */
+	lua_getfield(L, 1, "pool");
+	m->pool = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	/* set wait function */
+	lua_getfield(L, 1, "wait");
+	if (lua_isfunction(L, -1)) {
+		m->wait_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	} else {
+		lua_pop(L, 1);
+	}
 	
 	return 1;
 }
@@ -109,13 +189,140 @@ static const luaL_Reg functions[] = {
 };
 
 /*
- * Returns the connected socket for the key at the specified index.
+ * Closes a pooled socket.
+ */
+static void close_socket (void *conn) {
+	close((int) (intptr_t) conn);
+}
+
+/*
+ * Returns whether an idle socket is usable, i.e., neither closed by the
+ * server nor holding unread data.
  */
-static int get_socket (lua_State *L, memcached_rec *m, int index) {
-	const char *host, *port;
+static int is_healthy (int fd) {
+	char c;
+
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+			&& (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Connects a socket to a memcached server.
+ */
+static int connect_socket (lua_State *L, const char *host, const char *port) {
 	int fd, flag;
 	struct addrinfo hints, *results, *rp;
 
+	/* resolve */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &results)) {
+		luaL_error(L, "error resolving '%s:%s", host, port);
+	}
+
+	/* connect */
+	for (rp = results; rp != NULL; rp = rp->ai_next) {
+		/* create socket */
+		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+
+		/* disable Nagle algorithm */
+		if (rp->ai_protocol == IPPROTO_TCP) {
+			flag = 1;
+			if (setsockopt(fd, rp->ai_protocol, TCP_NODELAY,
+					&flag, sizeof(flag)) == -1) {
+				close(fd);
+				continue;
+			}
+		}
+
+		/* reuse address */
+		flag = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag,
+				sizeof(flag)) == -1) {
+			close(fd);
+			continue;
+		}
+
+		/* connect */
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) == -1) {
+			close(fd);
+			continue;
+		}
+
+		/* make non-blocking */
+		if ((flag = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL,
+				flag | O_NONBLOCK) == -1) {
+			close(fd);
+			continue;
+		}
+
+		/* success */
+		break;
+	}
+	if (rp == NULL) {
+		freeaddrinfo(results);
+		luaL_error(L, "error connecting to '%s:%s', %s (%d)", host,
+				port, strerror(errno), errno);
+	}
+	freeaddrinfo(results);
+
+	return fd;
+}
+
+/*
+ * Creates an exchange and pushes it onto the stack.
+ */
+static memcached_exchange *new_exchange (lua_State *L, int op) {
+	memcached_exchange *x;
+
+	x = (memcached_exchange *) lua_newuserdata(L,
+			sizeof(memcached_exchange));
+	memset(x, 0, sizeof(memcached_exchange));
+	x->fd = -1;
+	x->op = op;
+	x->in_need = sizeof(protocol_binary_response_header);
+	luaL_getmetatable(L, CACHE_MEMCACHED_EXCHANGE_METATABLE);
+	lua_setmetatable(L, -2);
+	return x;
+}
+
+/*
+ * Frees an exchange. The socket of an exchange that has not completed, for
+ * example because its coroutine was never resumed, is closed.
+ */
+static int free_exchange (lua_State *L) {
+	memcached_exchange *x;
+
+	x = (memcached_exchange *) luaL_checkudata(L, 1,
+			CACHE_MEMCACHED_EXCHANGE_METATABLE);
+	if (x->fd != -1) {
+		close(x->fd);
+		x->fd = -1;
+	}
+	free(x->key);
+	x->key = NULL;
+	free(x->out);
+	x->out = NULL;
+	free(x->in);
+	x->in = NULL;
+	return 0;
+}
+
+/*
+ * Checks out a socket for the key at the specified index. The socket is held
+ * by the exchange until the exchange completes, so concurrent exchanges with
+ * the same server use separate sockets.
+ */
+static void checkout_socket (lua_State *L, memcached_rec *m,
+		memcached_exchange *x, int index) {
+	const char *host, *port, *key;
+	int fd;
+	void *conn;
+
 	/* determine the server */
 	lua_rawgeti(L, LUA_REGISTRYINDEX, m->map_index);
 	lua_pushvalue(L, index);
@@ -125,241 +332,491 @@ static int get_socket (lua_State *L, memcached_rec *m, int index) {
 	}
 	host = lua_tostring(L, -2);
 	port = lua_tostring(L, -1);
-	lua_pop(L, 2);
+	key = lua_pushfstring(L, "%s:%s", host, port);
+	if ((x->key = strdup(key)) == NULL) {
+		luaL_error(L, "out of memory");
+	}
 
-	/* find server, connecting as needed */
+	/* take the idle socket of the connector */
 	lua_rawgeti(L, LUA_REGISTRYINDEX, m->sockets_index);
-	lua_pushfstring(L, "%s:%s", host, port);
+	lua_pushvalue(L, -2);
 	lua_rawget(L, -2);
 	if (!lua_isnil(L, -1)) {
 		fd = (int) lua_tointeger(L, -1);
-		lua_pop(L, 1);
+		lua_pushvalue(L, -3);
+		lua_pushnil(L);
+		lua_rawset(L, -4);
 	} else {
-		/* remove the nil */
-		lua_pop(L, 1);
-
-		/* resolve */
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		if (getaddrinfo(host, port, &hints, &results)) {
-			luaL_error(L, "error resolving '%s:%s", host, port);
+		/* check out an idle socket as requested */
+		fd = -1;
+		if (m->pool) {
+			while (is_pool_checkout(key, close_socket, &conn)) {
+				fd = (int) (intptr_t) conn;
+				if (is_healthy(fd)) {
+					break;
+				}
+				close(fd);
+				fd = -1;
+			}
 		}
 
 		/* connect */
-		for (rp = results; rp != NULL; rp = rp->ai_next) {
-			/* create socket */
-			fd = socket(rp->ai_family, rp->ai_socktype,
-					rp->ai_protocol);
-			if (fd == -1) {
-				continue;
-			}
+		if (fd == -1) {
+			fd = connect_socket(L, host, port);
+		}
+	}
+	lua_pop(L, 5);
+	x->fd = fd;
+}
 
-			/* disable Nagle algorithm */
-			if (rp->ai_protocol == IPPROTO_TCP) {
-				flag = 1;
-				if (setsockopt(fd, rp->ai_protocol, TCP_NODELAY,
-						&flag, sizeof(flag)) == -1) {
-					close(fd);
-					continue;
-				}
-			}
+/*
+ * Checks in the socket of a completed exchange. The socket becomes the idle
+ * socket of the connector unless the connector is closed or already has one,
+ * in which case the socket is pooled or closed.
+ */
+static void checkin_socket (lua_State *L, memcached_rec *m,
+		memcached_exchange *x) {
+	int fd;
 
-			/* reuse address */
-			flag = 1;
-			if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag,
-					sizeof(flag)) == -1) {
-				close(fd);
-				continue;
-			}
+	fd = x->fd;
+	x->fd = -1;
+	if (m->sockets_index) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m->sockets_index);
+		lua_getfield(L, -1, x->key);
+		if (lua_isnil(L, -1)) {
+			lua_pushinteger(L, fd);
+			lua_setfield(L, -3, x->key);
+			lua_pop(L, 2);
+			return;
+		}
+		lua_pop(L, 2);
+	}
+	if (m->pool) {
+		is_pool_return(x->key, (void *) (intptr_t) fd, close_socket);
+	} else {
+		close(fd);
+	}
+}
 
-			/* connect */
-			if (connect(fd, rp->ai_addr, rp->ai_addrlen) == -1) {
-				close(fd);
-				continue;
-			}
+/*
+ * Closes the socket of a failed exchange and raises an error. A partially
+ * sent request or unread response thus cannot reach a later request.
+ */
+static int fail (lua_State *L, memcached_exchange *x, const char *msg) {
+	if (x->fd != -1) {
+		close(x->fd);
+		x->fd = -1;
+	}
+	return luaL_error(L, "%s", msg);
+}
 
-			/* success */
-			break;
+/*
+ * Ensures the capacity of an exchange buffer.
+ */
+static char *ensure_capacity (lua_State *L, char **buf, size_t *capacity,
+		size_t needed) {
+	size_t new_capacity;
+	char *new_buf;
+
+	if (needed > *capacity) {
+		new_capacity = *capacity > 0 ? *capacity
+				: CACHE_MEMCACHED_BUFSIZE;
+		while (new_capacity < needed) {
+			new_capacity *= 2;
 		}
-		if (rp == NULL) {
-			freeaddrinfo(results);
-			luaL_error(L, "error connecting to '%s:%s', %s (%d)",
-					host, port, strerror(errno), errno);
+		if ((new_buf = (char *) realloc(*buf, new_capacity)) == NULL) {
+			luaL_error(L, "out of memory");
 		}
-		freeaddrinfo(results);
-
-		/* store socket */
-		lua_pushfstring(L, "%s:%s", host, port);
-		lua_pushinteger(L, fd);
-		lua_rawset(L, -3);
+		*buf = new_buf;
+		*capacity = new_capacity;
 	}
-	lua_pop(L, 1);
+	return *buf;
+}
 
-	return fd;	
+/*
+ * Appends data to the request of an exchange.
+ */
+static void append (lua_State *L, memcached_exchange *x, const void *data,
+		size_t len) {
+	ensure_capacity(L, &x->out, &x->out_capacity, x->out_len + len);
+	memcpy(&x->out[x->out_len], data, len);
+	x->out_len += len;
 }
 
 /*
- * Writes without SIGPIPE.
+ * Scans the received responses and returns whether the exchange is complete.
+ * Statistics end with a response without a key and value, or an error.
  */
-ssize_t write_nosigpipe (int fd, const void *buf, size_t count) {
-	struct sigaction new_action, old_action;
-	ssize_t result;
+static int scan (lua_State *L, memcached_exchange *x) {
+	protocol_binary_response_header header;
+	uint32_t bodylen;
 
-	/* ignore SIGPIPE */
-	memset(&new_action, 0, sizeof(new_action));
-	new_action.sa_handler = SIG_IGN;
-	sigemptyset(&new_action.sa_mask);
-	sigaction(SIGPIPE, &new_action, &old_action);
+	while (x->in_len - x->in_scan >= sizeof(header.bytes)) {
+		memcpy(header.bytes, &x->in[x->in_scan], sizeof(header.bytes));
+		if (header.response.magic != PROTOCOL_BINARY_RES) {
+			fail(L, x, "bad response");
+		}
+		bodylen = be32toh(header.response.bodylen);
+		x->in_need = x->in_scan + sizeof(header.bytes) + bodylen;
+		if (x->in_len < x->in_need) {
+			return 0;
+		}
+		x->in_scan = x->in_need;
+		if (x->op != CACHE_MEMCACHED_OSTAT || header.response.status
+				!= 0 || (header.response.keylen == 0
+				&& bodylen == 0)) {
+			return 1;
+		}
+	}
+	x->in_need = x->in_scan + sizeof(header.bytes);
+	return 0;
+}
+
+static int finish (lua_State *L, memcached_rec *m, memcached_exchange *x);
+
+/*
+ * Runs an exchange until it is complete and returns the results of its
+ * operation. If the socket is not ready and a wait function is configured,
+ * the pending key, the wait function, the socket, the events and the exchange
+ * at the specified index are returned instead; otherwise, the socket is
+ * polled.
+ */
+static int run (lua_State *L, memcached_rec *m, memcached_exchange *x,
+		int index) {
+	struct pollfd pfd;
+	ssize_t r;
+	int complete;
 
-	/* write */
-	result = write(fd, buf, count);
+	while (1) {
+		/* send */
+		while (x->out_pos < x->out_len) {
+			r = send(x->fd, &x->out[x->out_pos], x->out_len
+					- x->out_pos, MSG_NOSIGNAL);
+			if (r == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					break;
+				}
+				fail(L, x, "error sending request");
+			}
+			x->out_pos += r;
+		}
 
-	/* restore SIGPIPE */
-	sigaction(SIGPIPE, &old_action, NULL);
+		/* receive */
+		if (x->out_pos == x->out_len) {
+			complete = scan(L, x);
+			while (!complete) {
+				ensure_capacity(L, &x->in, &x->in_capacity,
+						x->in_need);
+				r = recv(x->fd, &x->in[x->in_len],
+						x->in_capacity - x->in_len, 0);
+				if (r == -1) {
+					if (errno == EINTR) {
+						continue;
+					}
+					if (errno == EAGAIN
+							|| errno == EWOULDBLOCK) {
+						break;
+					}
+					fail(L, x, "error reading response");
+				}
+				if (r == 0) {
+					fail(L, x, "socket closed");
+				}
+				x->in_len += r;
+				complete = scan(L, x);
+			}
+			if (complete) {
+				return finish(L, m, x);
+			}
+		}
 
-	return result;
+		/* wait */
+		pfd.fd = x->fd;
+		pfd.events = x->out_pos < x->out_len ? POLLOUT : POLLIN;
+		if (m->wait_index) {
+			lua_pushlightuserdata(L, &pending_key);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, m->wait_index);
+			lua_pushinteger(L, x->fd);
+			lua_pushstring(L, pfd.events == POLLOUT ? "w" : "r");
+			lua_pushvalue(L, index);
+			return 5;
+		}
+		while (poll(&pfd, 1, -1) == -1) {
+			if (errno != EINTR) {
+				fail(L, x, "error waiting for socket");
+			}
+		}
+	}
 }
 
 /*
- * Writes IO vectors without SIGPIPE.
+ * Starts the exchange at the specified index with the server of the key at
+ * the specified index, and runs it.
  */
-static ssize_t writev_nosigpipe (int fd, const struct iovec *iov, int iovcnt) {
-	struct sigaction new_action, old_action;
-	ssize_t result;
+static int exchange (lua_State *L, memcached_rec *m, int index, int key) {
+	memcached_exchange *x;
 
-	/* ignore SIGPIPE */
-	memset(&new_action, 0, sizeof(new_action));
-	new_action.sa_handler = SIG_IGN;
-	sigemptyset(&new_action.sa_mask);
-	sigaction(SIGPIPE, &new_action, &old_action);
-
-	/* write */
-	result = writev(fd, iov, iovcnt);
+	x = (memcached_exchange *) lua_touserdata(L, index);
+	checkout_socket(L, m, x, key);
+	return run(L, m, x, index);
+}
 
-	/* restore SIGPIPE */
-	sigaction(SIGPIPE, &old_action, NULL);
+/*
+ * Continues a pending exchange.
+ */
+static int continue_exchange (lua_State *L) {
+	memcached_rec *m;
+	memcached_exchange *x;
 
-	return result;
+	m = (memcached_rec *) luaL_checkudata(L, 1, CACHE_MEMCACHED_METATABLE);
+	x = (memcached_exchange *) luaL_checkudata(L, 2,
+			CACHE_MEMCACHED_EXCHANGE_METATABLE);
+	if (!m->sockets_index) {
+		luaL_error(L, "memcached connector is closed");
+	}
+	if (x->fd == -1) {
+		luaL_error(L, "memcached exchange is not pending");
+	}
+	return run(L, m, x, 2);
 }
 
 /*
- * Reads a response from a memcached server.
+ * Reads a response of a completed exchange.
  */
-static int read_response (lua_State *L, int fd, uint16_t *status, int parts,
-		int flags) {
-	protocol_binary_response_no_extras response;
-	size_t rtotal;
-	ssize_t r;
+static int read_response (lua_State *L, memcached_exchange *x,
+		uint16_t *status, int parts, int flags) {
+	protocol_binary_response_header header;
+	const char *p;
 	uint8_t extlen;
 	uint16_t keylen;
-	uint32_t bodylen;
-	luaL_Buffer B;
+	uint32_t bodylen, valuelen;
 	cache_buffer *b;
 	int nret = 0;
 
-	/* receive */
-	rtotal = 0;
-	do {
-		if ((r = read(fd, &response.bytes[rtotal],
-				sizeof(response.bytes) - rtotal)) == -1) {
-			luaL_error(L, "error reading response");
-		}
-		if (r == 0) {
-			luaL_error(L, "socket closed");
-		}
-		rtotal += r;
-	} while (rtotal < sizeof(response.bytes));
-	if (response.message.header.response.magic != PROTOCOL_BINARY_RES) {
-		luaL_error(L, "bad response");
+	/* header */
+	if (x->in_scan - x->in_pos < sizeof(header.bytes)) {
+		fail(L, x, "protocol error");
+	}
+	memcpy(header.bytes, &x->in[x->in_pos], sizeof(header.bytes));
+	p = &x->in[x->in_pos + sizeof(header.bytes)];
+	extlen = header.response.extlen;
+	keylen = be16toh(header.response.keylen);
+	bodylen = be32toh(header.response.bodylen);
+	if ((uint32_t) extlen + keylen > bodylen) {
+		fail(L, x, "bad response");
 	}
+	x->in_pos += sizeof(header.bytes) + bodylen;
 
 	/* status */
 	if (status) {
-		*status = be16toh(response.message.header.response.status);
+		*status = be16toh(header.response.status);
 	}
 
 	/* extras */
-	extlen = response.message.header.response.extlen;
-	keylen = be16toh(response.message.header.response.keylen);
-	bodylen = be32toh(response.message.header.response.bodylen);
-	if (extlen) {
-		luaL_buffinit(L, &B);
-		rtotal = extlen;
-		while (rtotal > 0) {
-			r = rtotal;
-			if (r > LUAL_BUFFERSIZE) {
-				r = LUAL_BUFFERSIZE;
-			}
-			if ((r = read(fd, luaL_prepbuffer(&B), r)) == -1) {
-				luaL_error(L, "error reading response");
-			}
-			luaL_addsize(&B, r);
-			rtotal -= r;
-		}
-		luaL_pushresult(&B);
-		if (parts & CACHE_MEMCACHED_EXTRAS) {
-			nret++;
-		} else {
-			lua_pop(L, 1);
-		}
+	if (extlen && (parts & CACHE_MEMCACHED_EXTRAS)) {
+		lua_pushlstring(L, p, extlen);
+		nret++;
 	}
+	p += extlen;
 
 	/* key */
-	if (keylen) {
-		luaL_buffinit(L, &B);
-		rtotal = keylen;
-		while (rtotal > 0) {
-			r = rtotal;
-			if (r > LUAL_BUFFERSIZE) {
-				r = LUAL_BUFFERSIZE;
-			}
-			if ((r = read(fd, luaL_prepbuffer(&B), r)) == -1) {
-				luaL_error(L, "error reading response");
-			}
-			luaL_addsize(&B, r);
-			rtotal -= r;
-		}
-		luaL_pushresult(&B);
-		if (parts & CACHE_MEMCACHED_KEY) {
-			nret++;
+	if (keylen && (parts & CACHE_MEMCACHED_KEY)) {
+		lua_pushlstring(L, p, keylen);
+		nret++;
+	}
+	p += keylen;
+
+	/* value */
+	valuelen = bodylen - extlen - keylen;
+	if (valuelen && (parts & CACHE_MEMCACHED_VALUE)) {
+		if (flags & CACHE_MEMCACHED_STRING) {
+			lua_pushlstring(L, p, valuelen);
 		} else {
-			lua_pop(L, 1);
+			b = (cache_buffer *) lua_newuserdata(L,
+					sizeof(cache_buffer));
+			memset(b, 0, sizeof(cache_buffer));
+			luaL_getmetatable(L, CACHE_BUFFER_METATABLE);
+			lua_setmetatable(L, -2);
+			b->b = (char *) malloc(valuelen);
+			if (b->b == NULL) {
+				luaL_error(L, "out of memory");
+			}
+			b->capacity = valuelen;
+			memcpy(b->b, p, valuelen);
+			b->pos = valuelen;
 		}
+		nret++;
 	}
 
-	/* value */
-	if (bodylen > extlen + keylen) {
-		rtotal = bodylen - (extlen + keylen);
-		b = (cache_buffer *) lua_newuserdata(L, sizeof(cache_buffer));
-		memset(b, 0, sizeof(cache_buffer));
-		luaL_getmetatable(L, CACHE_BUFFER_METATABLE);
-		lua_setmetatable(L, -2);
-		b->b = (char *) malloc(rtotal);
-		if (b->b == NULL) {
-			luaL_error(L, "out of memory");
+	return nret;
+}
+
+/*
+ * Returns the results of a retrieval.
+ */
+static int finish_get (lua_State *L, memcached_rec *m,
+		memcached_exchange *x) {
+	uint16_t status;
+	int nret;
+
+	/* push decode function */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->decode_index);
+
+	/* read response */
+	nret = read_response(L, x, &status, CACHE_MEMCACHED_VALUE, 0);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		if (nret != 1) {
+			fail(L, x, "protocol error");
 		}
-		b->capacity = rtotal;
-		while (rtotal > 0) {
-			r = rtotal;
-			if ((r = read(fd, &b->b[b->pos], r)) == -1) {
-				luaL_error(L, "error reading response");
-			}
-			b->pos += r;
-			rtotal -= r;
+		lua_call(L, 1, 1);
+		return 1;
+
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+		lua_pushnil(L);
+		return 1;
+
+	default:
+		return luaL_error(L, "memcached error %d", (int) status);
+	}
+}
+
+/*
+ * Returns the results of a store or delete.
+ */
+static int finish_set (lua_State *L, memcached_rec *m,
+		memcached_exchange *x) {
+	uint16_t status;
+
+	/* read response */
+	read_response(L, x, &status, 0, 0);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		lua_pushboolean(L, 1);
+		return 1;
+
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+	case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
+		lua_pushboolean(L, 0);
+		return 1;
+
+	default:
+		return luaL_error(L, "memcached error %d", (int) status);
+	}
+}
+
+/*
+ * Returns the results of an increment.
+ */
+static int finish_increment (lua_State *L, memcached_rec *m,
+		memcached_exchange *x) {
+	uint16_t status;
+	uint64_t value;
+	int nret;
+	size_t len;
+	const char *s;
+
+	/* read response */
+	nret = read_response(L, x, &status, CACHE_MEMCACHED_VALUE,
+			CACHE_MEMCACHED_STRING);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		if (nret != 1 || (s = lua_tolstring(L, -1, &len)) == NULL
+				|| len != sizeof(value)) {
+			fail(L, x, "protocol error");
 		}
-		if (parts & CACHE_MEMCACHED_VALUE) {
-			if (flags & CACHE_MEMCACHED_STRING) {
-				lua_pushlstring(L, b->b, b->pos);
-				lua_replace(L, -2);
+		memcpy(&value, s, sizeof(value));
+		cache_pushint64(L, be64toh(value));
+		return 1;
+
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+		lua_pushnil(L);
+		return 1;
+
+	default:
+		return luaL_error(L, "memcached error %d", (int) status);
+	}
+}
+
+/*
+ * Returns the results of a flush.
+ */
+static int finish_flush (lua_State *L, memcached_rec *m,
+		memcached_exchange *x) {
+	uint16_t status;
+
+	/* read response */
+	read_response(L, x, &status, 0, 0);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		return 0;
+
+	default:
+		return luaL_error(L, "memcached error %d", (int) status);
+	}
+}
+
+/*
+ * Returns the results of a statistics retrieval.
+ */
+static int finish_stat (lua_State *L, memcached_rec *m,
+		memcached_exchange *x) {
+	uint16_t status;
+	int nret;
+
+	/* read response */
+	lua_newtable(L);
+	while (1) {
+		nret = read_response(L, x, &status, CACHE_MEMCACHED_KEY 
+				| CACHE_MEMCACHED_VALUE,
+				CACHE_MEMCACHED_STRING);
+		switch (status) {
+		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+			switch (nret) {
+			case 0:
+				/* end of stats */
+				return 1;
+			
+			case 2:
+				lua_rawset(L, -3);
+				break;
+
+			default:
+				fail(L, x, "protocol error");
 			}
-			nret++;
-		} else {
-			lua_pop(L, 1);
+			break;
+
+		default:
+			return luaL_error(L, "memcached error %d",
+					(int) status);
 		}
 	}
+}
 
-	return nret;
+/*
+ * Completes an exchange and returns the results of its operation.
+ */
+static int finish (lua_State *L, memcached_rec *m, memcached_exchange *x) {
+	checkin_socket(L, m, x);
+	switch (x->op) {
+	case CACHE_MEMCACHED_OGET:
+		return finish_get(L, m, x);
+
+	case CACHE_MEMCACHED_OSET:
+		return finish_set(L, m, x);
+
+	case CACHE_MEMCACHED_OINCREMENT:
+		return finish_increment(L, m, x);
+
+	case CACHE_MEMCACHED_OFLUSH:
+		return finish_flush(L, m, x);
+
+	default:
+		return finish_stat(L, m, x);
+	}
 }
 
 /*
@@ -367,12 +824,11 @@ static int read_response (lua_State *L, int fd, uint16_t *status, int parts,
  */
 static int get (lua_State *L) {
 	memcached_rec *m;
+	memcached_exchange *x;
+	int index;
 	const char *key;
 	size_t keylen;
 	protocol_binary_request_get request;
-	int fd, nret;
-	struct iovec iov[2];
-	uint16_t status;
 
 	m = (memcached_rec *) luaL_checkudata(L, 1, CACHE_MEMCACHED_METATABLE);
 	if (!m->sockets_index) {
@@ -387,37 +843,13 @@ static int get (lua_State *L) {
 	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET;
 	request.message.header.request.keylen = htobe16((uint16_t) keylen);
 	request.message.header.request.bodylen = htobe32((uint32_t) keylen);
+	x = new_exchange(L, CACHE_MEMCACHED_OGET);
+	index = lua_gettop(L);
+	append(L, x, &request, sizeof(request.bytes));
+	append(L, x, key, (uint16_t) keylen);
 
-	/* send request */
-	fd = get_socket(L, m, 2);
-	iov[0].iov_base = &request;
-	iov[0].iov_len = sizeof(request.bytes);
-	iov[1].iov_base = (void *) key;
-	iov[1].iov_len = (uint16_t) keylen;
-	if (writev_nosigpipe(fd, iov, 2) == -1) {
-		luaL_error(L, "error sending request");
-	}
-
-	/* push decode function */
-	lua_rawgeti(L, LUA_REGISTRYINDEX, m->decode_index);
-
-	/* read response */
-	nret = read_response(L, fd, &status, CACHE_MEMCACHED_VALUE, 0);
-	switch (status) {
-	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-		if (nret != 1) {
-			luaL_error(L, "protocol error");
-		}
-		lua_call(L, 1, 1);
-		return 1;
-
-	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
-		lua_pushnil(L);
-		return 1;
-
-	default:
-		return luaL_error(L, "memcached error %d", (int) status);
-	}
+	/* exchange */
+	return exchange(L, m, index, 2);
 }
 
 /*
@@ -425,15 +857,14 @@ static int get (lua_State *L) {
  */
 static int set (lua_State *L) {
 	memcached_rec *m;
+	memcached_exchange *x;
+	int index;
 	const char *key, *value;
 	size_t keylen, valuelen;
 	cache_buffer *b;
 	double expiration;
 	protocol_binary_request_set srequest;
 	protocol_binary_request_delete drequest;
-	int fd;
-	struct iovec iov[3];
-	uint16_t status;
 
 	m = (memcached_rec *) luaL_checkudata(L, 1, CACHE_MEMCACHED_METATABLE);
 	if (!m->sockets_index) {
@@ -445,6 +876,8 @@ static int set (lua_State *L) {
 	expiration = luaL_optnumber(L, 4, 0);
 
 	/* handle both set and delete */
+	x = new_exchange(L, CACHE_MEMCACHED_OSET);
+	index = lua_gettop(L);
 	if (!lua_isnil(L, 3)) {
 		/* encode */
 		lua_rawgeti(L, LUA_REGISTRYINDEX, m->encode_index);
@@ -470,18 +903,9 @@ static int set (lua_State *L) {
 				htobe32((uint32_t) (8 + keylen + valuelen));
 		srequest.message.body.expiration =
 				htobe32((uint32_t) expiration);
-
-		/* send request */
-		fd = get_socket(L, m, 2);
-		iov[0].iov_base = &srequest;
-		iov[0].iov_len = sizeof(srequest.bytes);
-		iov[1].iov_base = (void *) key;
-		iov[1].iov_len = (uint16_t) keylen;
-		iov[2].iov_base = (void *) value;
-		iov[2].iov_len = valuelen;
-		if (writev_nosigpipe(fd, iov, 3) == -1) {
-			luaL_error(L, "error sending request");
-		}
+		append(L, x, &srequest, sizeof(srequest.bytes));
+		append(L, x, key, (uint16_t) keylen);
+		append(L, x, value, valuelen);
 	} else {
 		/* prepare request */
 		memset(&drequest, 0, sizeof(drequest));
@@ -492,33 +916,12 @@ static int set (lua_State *L) {
 				htobe16((uint16_t) keylen);
 		drequest.message.header.request.bodylen =
 				htobe32((uint32_t) keylen);
-
-		/* send request */
-		fd = get_socket(L, m, 2);
-		iov[0].iov_base = &drequest;
-		iov[0].iov_len = sizeof(drequest.bytes);
-		iov[1].iov_base = (void *) key;
-		iov[1].iov_len = (uint16_t) keylen;
-		if (writev_nosigpipe(fd, iov, 2) == -1) {
-			luaL_error(L, "error sending request");
-		}
+		append(L, x, &drequest, sizeof(drequest.bytes));
+		append(L, x, key, (uint16_t) keylen);
 	}
 
-	/* read response */
-	read_response(L, fd, &status, 0, 0);
-	switch (status) {
-	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-		lua_pushboolean(L, 1);
-		return 1;
-
-	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
-	case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
-		lua_pushboolean(L, 0);
-		return 1;
-
-	default:
-		return luaL_error(L, "memcached error %d", (int) status);
-	}
+	/* exchange */
+	return exchange(L, m, index, 2);
 }
 
 /*
@@ -526,14 +929,13 @@ static int set (lua_State *L) {
  */
 static int increment (lua_State *L) {
 	memcached_rec *m;
+	memcached_exchange *x;
+	int index;
 	const char *key;
 	size_t keylen;
-	double delta, initial, expiration;
+	uint64_t delta, initial;
+	double expiration;
 	protocol_binary_request_incr request;
-	int fd, nret;
-	struct iovec iov[2];
-	uint16_t status;
-	uint64_t value;
 
 	m = (memcached_rec *) luaL_checkudata(L, 1, CACHE_MEMCACHED_METATABLE);
 	if (!m->sockets_index) {
@@ -541,8 +943,10 @@ static int increment (lua_State *L) {
 	}
 	key = luaL_checkstring(L, 2);
 	keylen = lua_rawlen(L, 2);
-	delta = luaL_optnumber(L, 3, 1);
-	initial = luaL_optnumber(L, 4, 1);
+	delta = lua_isinteger(L, 3) ? (uint64_t) lua_tointeger(L, 3)
+			: (uint64_t) luaL_optnumber(L, 3, 1);
+	initial = lua_isinteger(L, 4) ? (uint64_t) lua_tointeger(L, 4)
+			: (uint64_t) luaL_optnumber(L, 4, 1);
 	expiration = luaL_optnumber(L, 5, 0);
 
 	/* prepare request */
@@ -554,39 +958,16 @@ static int increment (lua_State *L) {
 	request.message.header.request.keylen = htobe16((uint16_t) keylen);
 	request.message.header.request.bodylen =
 				htobe32((uint32_t) (20 + keylen));
-	request.message.body.delta = htobe64((uint64_t) delta);
-	request.message.body.initial = htobe64((uint64_t) initial);
+	request.message.body.delta = htobe64(delta);
+	request.message.body.initial = htobe64(initial);
 	request.message.body.expiration = htobe32((uint32_t) expiration);
+	x = new_exchange(L, CACHE_MEMCACHED_OINCREMENT);
+	index = lua_gettop(L);
+	append(L, x, &request, sizeof(request.bytes));
+	append(L, x, key, (uint16_t) keylen);
 
-	/* send request */
-	fd = get_socket(L, m, 2);
-	iov[0].iov_base = &request;
-	iov[0].iov_len = sizeof(request.bytes);
-	iov[1].iov_base = (void *) key;
-	iov[1].iov_len = (uint16_t) keylen;
-	if (writev_nosigpipe(fd, iov, 2) == -1) {
-		luaL_error(L, "error sending request");
-	}
-
-	/* read response */
-	nret = read_response(L, fd, &status, CACHE_MEMCACHED_VALUE,
-			CACHE_MEMCACHED_STRING);
-	switch (status) {
-	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-		if (nret != 1) {
-			luaL_error(L, "protocol error");
-		}
-		memcpy(&value, lua_tostring(L, -1), sizeof(value));
-		lua_pushnumber(L, be64toh(value));
-		return 1;
-
-	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
-		lua_pushnil(L);
-		return 1;
-
-	default:
-		return luaL_error(L, "memcached error %d", (int) status);
-	}
+	/* exchange */
+	return exchange(L, m, index, 2);
 }
 
 /*
@@ -594,10 +975,10 @@ static int increment (lua_State *L) {
  */
 static int flush (lua_State *L) {
 	memcached_rec *m;
+	memcached_exchange *x;
+	int index;
 	double expiration;
 	protocol_binary_request_flush request;
-	int fd;
-	uint16_t status;
 
 	m = (memcached_rec *) luaL_checkudata(L, 1, CACHE_MEMCACHED_METATABLE);
 	if (!m->sockets_index) {
@@ -613,22 +994,12 @@ static int flush (lua_State *L) {
 	request.message.header.request.extlen = 4;
 	request.message.header.request.bodylen = htobe32((uint32_t) 4);
 	request.message.body.expiration = htobe32((uint32_t) expiration);
+	x = new_exchange(L, CACHE_MEMCACHED_OFLUSH);
+	index = lua_gettop(L);
+	append(L, x, &request, sizeof(request.bytes));
 
-	/* send request */
-	fd = get_socket(L, m, 2);
-	if (write_nosigpipe(fd, &request, sizeof(request.bytes)) == -1) {
-		luaL_error(L, "error sending request");
-	}
-
-	/* read response */
-	read_response(L, fd, &status, 0, 0);
-	switch (status) {
-	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-		return 0;
-
-	default:
-		return luaL_error(L, "memcached error %d", (int) status);
-	}
+	/* exchange */
+	return exchange(L, m, index, 2);
 }
 
 /*
@@ -636,12 +1007,11 @@ static int flush (lua_State *L) {
  */
 static int stat (lua_State *L) {
 	memcached_rec *m;
+	memcached_exchange *x;
+	int index;
 	const char *key;
 	size_t keylen;
 	protocol_binary_request_stats request;
-	int fd, nret;
-	struct iovec iov[2];
-	uint16_t status;
 
 	m = (memcached_rec *) luaL_checkudata(L, 1, CACHE_MEMCACHED_METATABLE);
 	if (!m->sockets_index) {
@@ -657,44 +1027,15 @@ static int stat (lua_State *L) {
 	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_STAT;
 	request.message.header.request.keylen = htobe16((uint16_t) keylen);
 	request.message.header.request.bodylen = htobe32((uint32_t) keylen);
-
-	/* send request */
-	fd = get_socket(L, m, 2);
-	iov[0].iov_base = &request;
-	iov[0].iov_len = sizeof(request.bytes);
-	iov[1].iov_base = (void *) key;
-	iov[1].iov_len = (uint16_t) keylen;
-	if (writev_nosigpipe(fd, iov, 2) == -1) {
-		luaL_error(L, "error sending request");
+	x = new_exchange(L, CACHE_MEMCACHED_OSTAT);
+	index = lua_gettop(L);
+	append(L, x, &request, sizeof(request.bytes));
+	if (keylen) {
+		append(L, x, key, (uint16_t) keylen);
 	}
 
-	/* read response */
-	lua_newtable(L);
-	while (1) {
-		nret = read_response(L, fd, &status, CACHE_MEMCACHED_KEY 
-				| CACHE_MEMCACHED_VALUE,
-				CACHE_MEMCACHED_STRING);
-		switch (status) {
-		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-			switch (nret) {
-			case 0:
-				/* end of stats */
-				return 1;
-			
-			case 2:
-				lua_rawset(L, -3);
-				break;
-
-			default:
-				luaL_error(L, "protocol error");
-			}
-			break;
-
-		default:
-			return luaL_error(L, "memcached error %d",
-					(int) status);
-		}
-	}
+	/* exchange */
+	return exchange(L, m, index, 2);
 }
 
 /*
@@ -704,7 +1045,6 @@ static int mclose (lua_State *L) {
 	memcached_rec *m;
 	protocol_binary_request_quit request;
 	int fd;
-	uint16_t status;
 
 	m = luaL_checkudata(L, 1, CACHE_MEMCACHED_METATABLE);
 
@@ -715,18 +1055,21 @@ static int mclose (lua_State *L) {
 		request.message.header.request.opcode
 				= PROTOCOL_BINARY_CMD_QUIT;
 
-		/* quit and close sockets */
+		/* quit and close sockets, or return them as requested; the
+		 * quit response is not awaited */
 		lua_rawgeti(L, LUA_REGISTRYINDEX, m->sockets_index);
 		lua_pushnil(L);
 		while (lua_next(L, -2)) {
 			fd = (int) lua_tointeger(L, -1);
-			if (write_nosigpipe(fd, &request, sizeof(request))
-					!= -1) {
-				read_response(L, fd, &status, 0, 0);
+			if (m->pool) {
+				is_pool_return(lua_tostring(L, -2),
+						(void *) (intptr_t) fd,
+						close_socket);
+			} else {
+				send(fd, &request, sizeof(request.bytes),
+						MSG_NOSIGNAL);
+				close(fd);
 			}
-
-			/* close */
-			close(fd);
 			lua_pop(L, 1);
 			lua_pushvalue(L, -1);
 			lua_pushnil(L);
@@ -737,6 +1080,10 @@ static int mclose (lua_State *L) {
 		luaL_unref(L, LUA_REGISTRYINDEX, m->sockets_index);
 		m->sockets_index = 0;
 	}
+	if (m->wait_index) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->wait_index);
+		m->wait_index = 0;
+	}
 	if (m->decode_index) {
 		luaL_unref(L, LUA_REGISTRYINDEX, m->decode_index);
 		m->decode_index = 0;
@@ -782,11 +1129,23 @@ static int tostring (lua_State *L) {
 }
 
 
+/*
+ * Wraps the function on top of the stack with the wrap function at the
+ * specified index.
+ */
+static void wrap (lua_State *L, int index) {
+	lua_pushvalue(L, index);
+	lua_insert(L, -2);
+	lua_call(L, 1, 1);
+}
+
 /*
  * Exported functions.
  */
 
 int luaopen_cache_memcached (lua_State *L) {
+	int wrap_index;
+
 	/* register functions */
 	#if LUA_VERSION_NUM >= 502
 	luaL_newlib(L, functions);
@@ -794,6 +1153,22 @@ int luaopen_cache_memcached (lua_State *L) {
 	luaL_register(L, luaL_checkstring(L, 1), functions);
 	#endif
 
+	/* create wrap function */
+	if (luaL_loadbuffer(L, wrap_chunk, sizeof(wrap_chunk) - 1,
+			"=memcached") != 0) {
+		return lua_error(L);
+	}
+	lua_pushlightuserdata(L, &pending_key);
+	lua_pushcfunction(L, continue_exchange);
+	lua_call(L, 2, 1);
+	wrap_index = lua_gettop(L);
+
+	/* create exchange metatable */
+	luaL_newmetatable(L, CACHE_MEMCACHED_EXCHANGE_METATABLE);
+	lua_pushcfunction(L, free_exchange);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
 	/* create cache metatable */
 	luaL_newmetatable(L, CACHE_MEMCACHED_METATABLE);
 	lua_pushcfunction(L, mclose);
@@ -802,30 +1177,38 @@ int luaopen_cache_memcached (lua_State *L) {
 	lua_setfield(L, -2, "__tostring");
 	lua_newtable(L);
 	lua_pushcfunction(L, get);
+	wrap(L, wrap_index);
 	lua_setfield(L, -2, CACHE_FGET);
 	lua_pushnumber(L, PROTOCOL_BINARY_CMD_SET);
 	lua_pushcclosure(L, set, 1);
+	wrap(L, wrap_index);
 	lua_setfield(L, -2, CACHE_FSET);
 	lua_pushnumber(L, PROTOCOL_BINARY_CMD_ADD);
 	lua_pushcclosure(L, set, 1);
+	wrap(L, wrap_index);
 	lua_setfield(L, -2, CACHE_FADD);
 	lua_pushnumber(L, PROTOCOL_BINARY_CMD_REPLACE);
 	lua_pushcclosure(L, set, 1);
+	wrap(L, wrap_index);
 	lua_setfield(L, -2, CACHE_FREPLACE);
 	lua_pushnumber(L, PROTOCOL_BINARY_CMD_INCREMENT);
 	lua_pushcclosure(L, increment, 1);
+	wrap(L, wrap_index);
 	lua_setfield(L, -2, CACHE_FINC);
 	lua_pushnumber(L, PROTOCOL_BINARY_CMD_DECREMENT);
 	lua_pushcclosure(L, increment, 1);
+	wrap(L, wrap_index);
 	lua_setfield(L, -2, CACHE_FDEC);
 	lua_pushcfunction(L, flush);
+	wrap(L, wrap_index);
 	lua_setfield(L, -2, CACHE_FFLUSH);
 	lua_pushcfunction(L, mclose);
 	lua_setfield(L, -2, CACHE_FCLOSE);
 	lua_pushcfunction(L, stat);
+	wrap(L, wrap_index);
 	lua_setfield(L, -2, "stat");
 	lua_setfield(L, -2, "__index");
-	lua_pop(L, 1);
+	lua_pop(L, 2);
 
 	return 1;
 }
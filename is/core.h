@@ -7,6 +7,17 @@
 
 #include <lua.h>
 
+/*
+ * Lua 5.3 integer compatibility. Before Lua 5.3, integers are pushed as
+ * numbers, which represent integers exactly up to 2^53.
+ */
+#if LUA_VERSION_NUM < 503
+#define lua_isinteger(L, i) 0
+#define is_pushint64(L, n) lua_pushnumber((L), (lua_Number) (n))
+#else
+#define is_pushint64(L, n) lua_pushinteger((L), (lua_Integer) (n))
+#endif
+
 /* IS fields */
 #define IS_FDRIVER "driver"
 #define IS_FCONNECT "connect"
@@ -12,6 +12,7 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include "core.h"
+#include "pool.h"
 #include "mysql.h"
 
 /*
@@ -34,11 +35,13 @@ typedef struct mysql_rec {
 	MYSQL *mysql;
 	MYSQL_STMT *stmt;
 	MYSQL_RES *res;
+	char *pool_key;
 	int intransaction;
 	int field_count;
 	MYSQL_FIELD *fields;
 	MYSQL_BIND bind[IS_MYSQL_MAXPARAM];
 	double doubles[IS_MYSQL_MAXPARAM];
+	int64_t longs[IS_MYSQL_MAXPARAM];
 	unsigned long lengths[IS_MYSQL_MAXPARAM];
 	my_bool nulls[IS_MYSQL_MAXPARAM];
 } mysql_rec;
@@ -86,6 +89,39 @@ static void error (lua_State *L, mysql_rec *m) {
 			mysql_sqlstate(m->mysql), mysql_error(m->mysql));
 }
 
+/*
+ * Closes a pooled MySQL connection.
+ */
+static void pool_close (void *conn) {
+	mysql_close((MYSQL *) conn);
+}
+
+/*
+ * Resets the session of a pooled MySQL connection. This rolls back open
+ * transactions, releases table locks, drops temporary tables, and clears
+ * user variables and session settings. Returns whether the connection is
+ * usable, which makes the reset the health check as well.
+ */
+static int reset_connection (MYSQL *mysql, const char *user,
+		const char *passwd, const char *db, const char *charset) {
+#if MYSQL_VERSION_ID >= 50703
+	if (mysql_reset_connection(mysql) != 0) {
+		return 0;
+	}
+	if (db && mysql_select_db(mysql, db) != 0) {
+		return 0;
+	}
+#else
+	if (mysql_change_user(mysql, user, passwd, db) != 0) {
+		return 0;
+	}
+#endif
+	if (charset && mysql_set_character_set(mysql, charset) != 0) {
+		return 0;
+	}
+	return 1;
+}
+
 /*
  * Connects to MySQL.
  */
@@ -93,6 +129,7 @@ static int connect (lua_State *L) {
 	mysql_rec *m;
 	const char *host, *user, *passwd, *db, *unix_socket, *charset;
 	int port;
+	void *conn;
 
 	luaL_checktype(L, 1, LUA_TTABLE);
 	host = get_string_field(L, 1, "host", NULL);
@@ -105,6 +142,35 @@ static int connect (lua_State *L) {
 
 	m = (mysql_rec *) lua_newuserdata(L, sizeof(mysql_rec));
 	memset(m, 0, sizeof(mysql_rec));
+	luaL_getmetatable(L, IS_MYSQL_METATABLE);
+	lua_setmetatable(L, -2);
+
+	/* check out a pooled connection as requested */
+	lua_getfield(L, 1, "pool");
+	if (lua_toboolean(L, -1)) {
+		lua_pushfstring(L, "%s\n%s\n%s\n%s\n%d\n%s\n%s",
+				host ? host : "", user ? user : "",
+				passwd ? passwd : "", db ? db : "", port,
+				unix_socket ? unix_socket : "",
+				charset ? charset : "");
+		if ((m->pool_key = strdup(lua_tostring(L, -1))) == NULL) {
+			lua_pushliteral(L, "MySQL error: out of memory");
+			lua_error(L);
+		}
+		lua_pop(L, 1);
+		while (is_pool_checkout(m->pool_key, pool_close, &conn)) {
+			m->mysql = (MYSQL *) conn;
+			if (reset_connection(m->mysql, user, passwd, db,
+					charset)) {
+				lua_pop(L, 1);
+				return 1;
+			}
+			mysql_close(m->mysql);
+			m->mysql = NULL;
+		}
+	}
+	lua_pop(L, 1);
+
 #ifdef _REENTRANT
 	if (pthread_mutex_lock(&lock) != 0) {
 		lua_pushliteral(L, "Error acquiring MySQL lock");
@@ -128,16 +194,17 @@ static int connect (lua_State *L) {
 				mysql_errno(m->mysql), mysql_sqlstate(m->mysql),
 				mysql_error(m->mysql));
 		mysql_close(m->mysql);
+		m->mysql = NULL;
 		lua_error(L);
 	}
 	if (charset) {
 		if (mysql_set_character_set(m->mysql, charset)) {
+			/* do not pool a connection with the wrong charset */
+			free(m->pool_key);
+			m->pool_key = NULL;
 			error(L, m);
 		}
 	}
-		
-	luaL_getmetatable(L, IS_MYSQL_METATABLE);
-	lua_setmetatable(L, -2);
 
 	return 1;
 }
@@ -158,9 +225,17 @@ static int close (lua_State *L) {
 		m->stmt = NULL;
 	}
 	if (m->mysql) {
-		mysql_close(m->mysql);
+		if (m->pool_key && !m->intransaction) {
+			is_pool_return(m->pool_key, m->mysql, pool_close);
+		} else {
+			mysql_close(m->mysql);
+		}
 		m->mysql = NULL;
 	}
+	if (m->pool_key) {
+		free(m->pool_key);
+		m->pool_key = NULL;
+	}
 
 	return 0;
 }
@@ -226,9 +301,15 @@ static int execute (lua_State *L) {
 			break;
 
 		case LUA_TNUMBER:
-			m->bind[i].buffer_type = MYSQL_TYPE_DOUBLE;
-			m->doubles[i] = (double) lua_tonumber(L, i + 3);
-			m->bind[i].buffer = &m->doubles[i];
+			if (lua_isinteger(L, i + 3)) {
+				m->bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+				m->longs[i] = (int64_t) lua_tointeger(L, i + 3);
+				m->bind[i].buffer = &m->longs[i];
+			} else {
+				m->bind[i].buffer_type = MYSQL_TYPE_DOUBLE;
+				m->doubles[i] = (double) lua_tonumber(L, i + 3);
+				m->bind[i].buffer = &m->doubles[i];
+			}
 			break;
 
 		case LUA_TSTRING:
@@ -274,6 +355,13 @@ static int execute (lua_State *L) {
 			case MYSQL_TYPE_LONG:
 			case MYSQL_TYPE_INT24:
 			case MYSQL_TYPE_LONGLONG:
+				m->bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+				m->bind[i].buffer = &m->longs[i];
+				m->bind[i].is_unsigned = (m->fields[i].flags
+						& UNSIGNED_FLAG) != 0;
+				m->bind[i].is_null = &m->nulls[i];
+				break;
+
 			case MYSQL_TYPE_DECIMAL:
 			case MYSQL_TYPE_NEWDECIMAL:
 			case MYSQL_TYPE_FLOAT:
@@ -354,6 +442,18 @@ void read_string (lua_State *L, mysql_rec *m, int i) {
 	luaL_pushresult(&b);
 }
 
+/*
+ * Fetches an integer column. Unsigned values beyond the signed 64-bit range
+ * are pushed as numbers.
+ */
+void read_integer (lua_State *L, mysql_rec *m, int i) {
+	if (m->bind[i].is_unsigned && m->longs[i] < 0) {
+		lua_pushnumber(L, (lua_Number) (uint64_t) m->longs[i]);
+	} else {
+		is_pushint64(L, m->longs[i]);
+	}
+}
+
 /*
  * Fetches a bit column.
  */
@@ -371,7 +471,7 @@ void read_bit (lua_State *L, mysql_rec *m, int i) {
 			bit_value <<= 8;
 			bit_value |= bits[j];
 		}
-		lua_pushnumber(L, (lua_Number) bit_value);
+		is_pushint64(L, bit_value);
 	}
 }
 	
@@ -416,6 +516,10 @@ static int read (lua_State *L) {
 				lua_pushnil(L);
 				break;
 
+			case MYSQL_TYPE_LONGLONG:
+				read_integer(L, m, i);
+				break;
+
 			case MYSQL_TYPE_DOUBLE:
 				lua_pushnumber(L, m->doubles[i]);
 				break;
@@ -793,7 +897,7 @@ static int insert_id (lua_State *L) {
 
 	insert_id = mysql_insert_id(m->mysql);
 	
-	lua_pushnumber(L, (lua_Number) insert_id);
+	is_pushint64(L, insert_id);
 	return 1;
 }
 
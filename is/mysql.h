@@ -5,7 +5,7 @@
 #ifndef IS_MYSQL_INCLUDED
 #define IS_MYSQL_INCLUDED
 
-#include <lua5.1/lua.h>
+#include <lua.h>
 
 /*
  * Opens the IS MySQL module.
@@ -0,0 +1,167 @@
+/*
+ * Provides the IS connection pool. The pool is also linked into the cache
+ * memcached module. See LICENSE for license terms.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif
+#include "pool.h"
+
+/*
+ * Pool entry.
+ */
+typedef struct pool_entry {
+	char *key;
+	void *conn;
+	is_pool_close_t close;
+	time_t since;
+} pool_entry;
+
+/*
+ * Idle connections, ordered from least to most recently returned.
+ */
+static pool_entry entries[IS_POOL_MAXIDLE];
+static int entry_count = 0;
+
+/*
+ * Pinned flag.
+ */
+static int pinned = 0;
+
+#ifdef _REENTRANT
+/*
+ * Pool mutex.
+ */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Keeps the driver library loaded. Drivers are unloaded when the Lua state
+ * that required them is closed, which would discard the pool.
+ */
+static void pin (void) {
+	Dl_info info;
+
+	if (pinned) {
+		return;
+	}
+	if (dladdr((void *) pin, &info) && info.dli_fname) {
+		dlopen(info.dli_fname, RTLD_LAZY | RTLD_NODELETE);
+	}
+	pinned = 1;
+}
+
+/*
+ * Removes an entry.
+ */
+static void remove_entry (int index) {
+	free(entries[index].key);
+	memmove(&entries[index], &entries[index + 1], (entry_count - index - 1)
+			* sizeof(pool_entry));
+	entry_count--;
+}
+
+/*
+ * Exported functions.
+ */
+
+int is_pool_checkout (const char *key, is_pool_close_t close, void **conn) {
+	pool_entry expired[IS_POOL_MAXIDLE];
+	int expired_count, found, i;
+	time_t now;
+
+	found = 0;
+	expired_count = 0;
+	now = time(NULL);
+#ifdef _REENTRANT
+	if (pthread_mutex_lock(&pool_mutex) != 0) {
+		return 0;
+	}
+#endif
+
+	/* expire idle connections */
+	i = 0;
+	while (i < entry_count) {
+		if (now - entries[i].since > IS_POOL_MAXIDLETIME) {
+			expired[expired_count++] = entries[i];
+			entries[i].key = NULL;
+			remove_entry(i);
+		} else {
+			i++;
+		}
+	}
+
+	/* take the most recently returned connection with the key */
+	for (i = entry_count - 1; i >= 0; i--) {
+		if (strcmp(entries[i].key, key) == 0
+				&& entries[i].close == close) {
+			*conn = entries[i].conn;
+			found = 1;
+			remove_entry(i);
+			break;
+		}
+	}
+
+#ifdef _REENTRANT
+	pthread_mutex_unlock(&pool_mutex);
+#endif
+
+	/* close expired connections outside the lock */
+	for (i = 0; i < expired_count; i++) {
+		expired[i].close(expired[i].conn);
+		free(expired[i].key);
+	}
+
+	return found;
+}
+
+void is_pool_return (const char *key, void *conn, is_pool_close_t close) {
+	pool_entry evicted;
+	char *entry_key;
+	int has_evicted;
+
+	if ((entry_key = strdup(key)) == NULL) {
+		close(conn);
+		return;
+	}
+	has_evicted = 0;
+#ifdef _REENTRANT
+	if (pthread_mutex_lock(&pool_mutex) != 0) {
+		free(entry_key);
+		close(conn);
+		return;
+	}
+#endif
+	pin();
+
+	/* evict the least recently returned connection as needed */
+	if (entry_count == IS_POOL_MAXIDLE) {
+		evicted = entries[0];
+		has_evicted = 1;
+		entries[0].key = NULL;
+		remove_entry(0);
+	}
+
+	/* add */
+	entries[entry_count].key = entry_key;
+	entries[entry_count].conn = conn;
+	entries[entry_count].close = close;
+	entries[entry_count].since = time(NULL);
+	entry_count++;
+
+#ifdef _REENTRANT
+	pthread_mutex_unlock(&pool_mutex);
+#endif
+
+	/* close evicted connection outside the lock */
+	if (has_evicted) {
+		evicted.close(evicted.conn);
+		free(evicted.key);
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * Provides the IS connection pool. The pool is also linked into the cache
+ * memcached module. See LICENSE for license terms.
+ */
+
+#ifndef IS_POOL_INCLUDED
+#define IS_POOL_INCLUDED
+
+/*
+ * Pool parameters.
+ */
+#define IS_POOL_MAXIDLE 16
+#define IS_POOL_MAXIDLETIME 60
+
+/*
+ * Closes a pooled connection.
+ */
+typedef void (*is_pool_close_t) (void *conn);
+
+/*
+ * Checks out an idle connection from the process-wide pool. Connections that
+ * have been idle for longer than IS_POOL_MAXIDLETIME seconds are closed. The
+ * caller must check the health of the returned connection.
+ *
+ * @param key the connection key
+ * @param close the close function
+ * @param conn is assigned the idle connection
+ * @return 1 if an idle connection with the key was checked out, and 0
+ * otherwise
+ */
+int is_pool_checkout (const char *key, is_pool_close_t close, void **conn);
+
+/*
+ * Returns a connection to the process-wide pool. If the pool already holds
+ * IS_POOL_MAXIDLE connections, the least recently returned connection is
+ * closed. If the connection cannot be pooled, it is closed.
+ *
+ * @param key the connection key
+ * @param conn the connection
+ * @param close the close function
+ */
+void is_pool_return (const char *key, void *conn, is_pool_close_t close);
+
+#endif /* IS_POOL_INCLUDED */
@@ -183,9 +183,18 @@ static int execute (lua_State *L) {
 			break;
 
 		case LUA_TNUMBER:
-			if (sqlite3_bind_double(s->stmt, i + 1, lua_tonumber(
-					L, i + 3)) != SQLITE_OK) {
-				error(L, s);
+			if (lua_isinteger(L, i + 3)) {
+				if (sqlite3_bind_int64(s->stmt, i + 1,
+						lua_tointeger(L, i + 3))
+						!= SQLITE_OK) {
+					error(L, s);
+				}
+			} else {
+				if (sqlite3_bind_double(s->stmt, i + 1,
+						lua_tonumber(L, i + 3))
+						!= SQLITE_OK) {
+					error(L, s);
+				}
 			}
 			break;
 
@@ -216,7 +225,7 @@ static int execute (lua_State *L) {
 		s->column_count = sqlite3_column_count(s->stmt);
 		if (s->column_count == 0) {
 			/* return number of rows changed */
-			lua_pushnumber(L, sqlite3_changes(s->db));
+			lua_pushinteger(L, sqlite3_changes(s->db));
 			sqlite3_finalize(s->stmt);
 			s->stmt = NULL;
 			return 1;
@@ -272,6 +281,9 @@ static int read (lua_State *L) {
 		/* handle types */
 		switch (sqlite3_column_type(s->stmt, i)) {
 		case SQLITE_INTEGER:
+			is_pushint64(L, sqlite3_column_int64(s->stmt, i));
+			break;
+
 		case SQLITE_FLOAT:
 			lua_pushnumber(L, sqlite3_column_double(s->stmt, i));
 			break;
@@ -594,7 +606,7 @@ static int last_insert_rowid (lua_State *L) {
 		lua_error(L);
 	}
 
-	lua_pushnumber(L, (lua_Number) sqlite3_last_insert_rowid(s->db));
+	is_pushint64(L, sqlite3_last_insert_rowid(s->db));
 	return 1;
 }
 
@@ -13,6 +13,7 @@
 #include <sybdb.h>
 #include <syberror.h>
 #include "core.h"
+#include "pool.h"
 #include "tds.h"
 
 /*
@@ -35,6 +36,7 @@
  */
 typedef struct tds_rec {
 	DBPROCESS *db;
+	char *pool_key;
 	int intransaction;
 	int has_result;
 	int numcols;
@@ -169,6 +171,32 @@ static int error (lua_State *L) {
 	return luaL_error(L, "%s", lua_tostring(L, -1));
 }
 
+/*
+ * Closes a pooled TDS connection.
+ */
+static void pool_close (void *conn) {
+	dbclose((DBPROCESS *) conn);
+}
+
+/*
+ * Resets a pooled TDS connection by rolling back any open transaction and
+ * selecting the database. This is a round trip to the server, so it is the
+ * health check as well. Returns whether the connection is usable.
+ */
+static int reset_connection (DBPROCESS *db, const char *database) {
+	if (DBDEAD(db)) {
+		return 0;
+	}
+	if (dbcmd(db, "IF @@TRANCOUNT > 0 ROLLBACK") == FAIL
+			|| dbsqlexec(db) == FAIL || dbcancel(db) == FAIL) {
+		return 0;
+	}
+	if (database && dbuse(db, database) == FAIL) {
+		return 0;
+	}
+	return 1;
+}
+
 /*
  * Connects to a TDS server.
  */
@@ -177,6 +205,7 @@ static int connect (lua_State *L) {
 			*workstation, *charset;
 	LOGINREC *login;
 	tds_rec *t;
+	void *conn;
 
 	luaL_checktype(L, 1, LUA_TTABLE);
 	server = get_string_field(L, 1, "server");
@@ -193,6 +222,40 @@ static int connect (lua_State *L) {
 	workstation = get_string_field(L, 1, "workstation");
 	charset = get_string_field(L, 1, "charset");
 
+	/* allocate TDS record */
+	t = (tds_rec *) lua_newuserdata(L, sizeof(tds_rec));
+	memset(t, 0, sizeof(tds_rec));
+	luaL_getmetatable(L, IS_TDS_METATABLE);
+	lua_setmetatable(L, -2);
+
+	/* check out a pooled connection as requested */
+	lua_getfield(L, 1, "pool");
+	if (lua_toboolean(L, -1)) {
+		lua_pushfstring(L, "%s\n%s\n%s\n%s\n%s\n%s\n%s", server, user,
+				password ? password : "",
+				database ? database : "",
+				application ? application : "",
+				workstation ? workstation : "",
+				charset ? charset : "");
+		if ((t->pool_key = strdup(lua_tostring(L, -1))) == NULL) {
+			luaL_error(L, "TDS error: out of memory");
+		}
+		lua_pop(L, 1);
+		while (is_pool_checkout(t->pool_key, pool_close, &conn)) {
+			t->db = (DBPROCESS *) conn;
+			dbsetuserdata(t->db, (BYTE *) L);
+			if (reset_connection(t->db, database)) {
+				clear(L);
+				lua_pop(L, 1);
+				return 1;
+			}
+			clear(L);
+			dbclose(t->db);
+			t->db = NULL;
+		}
+	}
+	lua_pop(L, 1);
+
 	/* prepare login */
 	if ((login = dblogin()) == NULL) {
 		luaL_error(L, "TDS error: out of memory");
@@ -211,12 +274,6 @@ static int connect (lua_State *L) {
 		DBSETLCHARSET(login, charset);
 	}
 
-	/* allocate TDS record */
-	t = (tds_rec *) lua_newuserdata(L, sizeof(tds_rec));
-	memset(t, 0, sizeof(tds_rec));
-	luaL_getmetatable(L, IS_TDS_METATABLE);
-	lua_setmetatable(L, -2);
-
 	/* connect */
 	if ((t->db = dbopen(login, server)) == NULL) {
 		luaL_error(L, "TDS error: connection to %s failed", server);
@@ -226,6 +283,9 @@ static int connect (lua_State *L) {
 	/* select database */
 	if (database) {
 		if (dbuse(t->db, database) == FAIL) {
+			/* do not pool a connection in the wrong database */
+			free(t->pool_key);
+			t->pool_key = NULL;
 			error(L);
 		}
 	}
@@ -242,9 +302,22 @@ static int close (lua_State *L) {
 	clear(L);
 	t = (tds_rec *) luaL_checkudata(L, 1, IS_TDS_METATABLE);
 	if (t->db) {
-		dbclose(t->db);
+		if (t->pool_key && !t->intransaction) {
+			if (t->has_result) {
+				dbcancel(t->db);
+				t->has_result = 0;
+			}
+			dbsetuserdata(t->db, NULL);
+			is_pool_return(t->pool_key, t->db, pool_close);
+		} else {
+			dbclose(t->db);
+		}
 		t->db = NULL;
 	}
+	if (t->pool_key) {
+		free(t->pool_key);
+		t->pool_key = NULL;
+	}
 
 	return 0;
 }
@@ -296,10 +369,18 @@ static int execute (lua_State *L) {
 				break;
 
 			case LUA_TNUMBER:
-				bpos += snprintf(&t->buffer[bpos],
-						IS_TDS_BCAPACITY - bpos, "%g",
-						lua_tonumber(L, param_index
-						+ 3));
+				if (lua_isinteger(L, param_index + 3)) {
+					bpos += snprintf(&t->buffer[bpos],
+							IS_TDS_BCAPACITY - bpos,
+							"%lld", (long long)
+							lua_tointeger(L,
+							param_index + 3));
+				} else {
+					bpos += snprintf(&t->buffer[bpos],
+							IS_TDS_BCAPACITY - bpos,
+							"%.17g", lua_tonumber(L,
+							param_index + 3));
+				}
 				break;
 
 			case LUA_TSTRING:
@@ -374,7 +455,7 @@ static int execute (lua_State *L) {
 
 	case NO_MORE_RESULTS:
 		/* return number of rows affected */
-		lua_pushnumber(L, dbcount(t->db));
+		lua_pushinteger(L, dbcount(t->db));
 		return 1;
 
 	default:
@@ -392,6 +473,7 @@ static int read (lua_State *L) {
 	int i;
 	BYTE *data;
 	double double_value;
+	DBBIGINT bigint_value;
 	DBDATEREC date_value;
 
 	clear(L);
@@ -434,6 +516,15 @@ static int read (lua_State *L) {
 			case SYBINT2:
 			case SYBINT4:
 			case SYBINT8:
+				if (dbconvert(t->db, dbcoltype(t->db, i + 1),
+						data, dbdatlen(t->db, i + 1),
+						SYBINT8, (BYTE *) &bigint_value,
+						sizeof(bigint_value)) == -1) {
+					error(L);
+				}
+				is_pushint64(L, bigint_value);
+				break;
+
 			case SYBREAL:
 			case SYBFLT8:
 			case SYBNUMERIC:
@@ -3,21 +3,63 @@
  */
 
 #include <time.h>
-#include <apr_hash.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_thread_mutex.h>
 #include <apr_lib.h>
+#include <apr_md5.h>
 #include <httpd.h>
 #include <http_core.h>
 #include <http_protocol.h>
 #include <http_log.h>
+#include <util_time.h>
 #include <util_script.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include "util.h"
 #include "template.h"
+#include "json.h"
 #include "apache.h"
 
+/*
+ * Lua 5.1 compatibility.
+ */
+#if LUA_VERSION_NUM < 502
+#define lua_getuservalue(L, i) lua_getfenv(L, (i))
+#define lua_setuservalue(L, i) lua_setfenv(L, (i))
+#define lua_resume(L, from, n) lua_resume((L), (n))
+#endif
+
+/*
+ * Lua 5.3 compatibility.
+ */
+#if LUA_VERSION_NUM >= 503
+#define lua_dump(L, writer, data) lua_dump((L), (writer), (data), 0)
+#endif
+
+/*
+ * Lua 5.4 compatibility. Leaves only the yielded or returned values on the
+ * coroutine stack, as earlier versions do.
+ */
+#if LUA_VERSION_NUM >= 504
+static int resume (lua_State *co, lua_State *from, int nargs) {
+	int status, nres;
+
+	status = lua_resume(co, from, nargs, &nres);
+	if ((status == LUA_OK || status == LUA_YIELD)
+			&& lua_gettop(co) > nres) {
+		lua_rotate(co, 1, nres);
+		lua_settop(co, nres);
+	}
+	return status;
+}
+#define lua_resume(L, from, n) resume((L), (from), (n))
+#endif
 
 /*
  * LWT request state.
@@ -27,37 +69,105 @@ typedef struct lwt_request_rec {
 	int abort;
 	int in_ready;
 	char *body;
+	apr_size_t body_len;
+	int body_json;
 	int env_set;
+	int etag_set;
+	int output_started;
+	int eos;
+	int aborted;
+	apr_table_t *args;
+	apr_table_t *uploads;
+	struct multipart_rec *multipart;
+	int args_bad;
+	int maxargs;
+	apr_size_t argslimit;
+	apr_size_t filelimit;
 } lwt_request_rec;
 
+/*
+ * Returns the request arguments, decoding them on first access.
+ */
+static apr_table_t *get_args (lua_State *L, lwt_request_rec *lr);
+
+/*
+ * Returns whether the client connection has been aborted.
+ */
+static int is_aborted (lwt_request_rec *lr) {
+	if (!lr->aborted && lr->r->connection->aborted) {
+		lr->aborted = 1;
+	}
+	return lr->aborted;
+}
+
+/*
+ * Raises the client abort error. The error value is httpd.aborted, allowing
+ * handlers to catch it.
+ */
+static int raise_aborted (lua_State *L, lwt_request_rec *lr) {
+	lr->aborted = 1;
+	lr->abort = 1;
+	lua_getfield(L, LUA_REGISTRYINDEX, LWT_APACHE_ABORTED);
+	return lua_error(L);
+}
+
 /*
  * A field handler pushes a field from the request record.
  */
 typedef int (*request_rec_fh) (lua_State *L, lwt_request_rec *lr);
 
 /*
- * A hash of field handlers.
+ * Request record field.
+ */
+typedef struct request_rec_field {
+	const char *name;
+	size_t len;
+	request_rec_fh fh;
+	int memoize;
+} request_rec_field;
+
+/*
+ * Returns a request record field.
  */
-static apr_hash_t *request_rec_fhs;
+static const request_rec_field *get_request_rec_field (const char *name,
+		size_t len);
 
 /*
- * Provides the index metamethod for request recs.
+ * Provides the index metamethod for request recs. Field values are memoized
+ * in the user value table of the request rec.
  */
 static int request_rec_index (lua_State *L) {
 	lwt_request_rec *lr;
-	const char *field;
-	request_rec_fh fh;
+	const char *name;
+	size_t len;
+	const request_rec_field *f;
 
 	lr = (lwt_request_rec *) luaL_checkudata(L, 1,
 			LWT_APACHE_REQUEST_REC_METATABLE);
-	field = luaL_checkstring(L, 2);
-	fh = (request_rec_fh) apr_hash_get(request_rec_fhs, field,
-			strlen(field));
-	if (!fh) {
+	name = luaL_checklstring(L, 2, &len);
+
+	/* memoized? */
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	if (!lua_isnil(L, -1)) {
+		return 1;
+	}
+	lua_pop(L, 1);
+
+	/* push field */
+	f = get_request_rec_field(name, len);
+	if (!f) {
 		lua_pushnil(L);
 		return 1;
 	}
-	return fh(L, lr);
+	f->fh(L, lr);
+	if (f->memoize && !lua_isnil(L, -1)) {
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	return 1;
 }
 
 /*
@@ -146,8 +256,24 @@ static int args_fh (lua_State *L, lwt_request_rec *lr) {
 }	
 
 static int body_fh (lua_State *L, lwt_request_rec *lr) {
+	get_args(L, lr);
 	if (lr->body != NULL) {
-		lua_pushstring(L, lr->body);
+		lua_pushlstring(L, lr->body, lr->body_len);
+	} else {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int json_fh (lua_State *L, lwt_request_rec *lr) {
+	const char *err;
+
+	get_args(L, lr);
+	if (lr->body_json) {
+		if (lwt_json_decode(L, lr->body, lr->body_len, lr->r->pool,
+				&err) != APR_SUCCESS) {
+			luaL_error(L, "Error decoding JSON body: %s", err);
+		}
 	} else {
 		lua_pushnil(L);
 	}
@@ -287,39 +413,122 @@ static int useragent_ip_fh (lua_State *L, lwt_request_rec *lr) {
 
 
 /*
- * Adds a request record field handler.
+ * Request record field indexes.
  */
-static void add_request_rec_fh (const char *field, request_rec_fh fh) {
-	apr_hash_set(request_rec_fhs, field, strlen(field), fh);
-}
+enum {
+	FIELD_URI, FIELD_PROTOCOL, FIELD_HOSTNAME, FIELD_PATH, FIELD_PATH_INFO,
+	FIELD_ARGS, FIELD_BODY, FIELD_JSON, FIELD_METHOD, FIELD_STATUS,
+	FIELD_ENV, FIELD_HEADERS_IN, FIELD_HEADERS_OUT, FIELD_ERR_HEADERS_OUT,
+	FIELD_FILENAME, FIELD_FILEDIR, FIELD_USER, FIELD_AUTH_TYPE,
+	FIELD_LOCAL_IP, FIELD_REMOTE_IP, FIELD_USERAGENT_IP
+};
 
 /*
- * Initializes the request record field handlers.
+ * Request record fields, in field index order. Fields whose value does not
+ * change during the request, or which wrap a live APR table, are memoized.
  */
-static void init_request_rec_fh (apr_pool_t *pool) {
-	request_rec_fhs = apr_hash_make(pool);
-	add_request_rec_fh("uri", uri_fh);
-	add_request_rec_fh("protocol", protocol_fh);
-	add_request_rec_fh("hostname", hostname_fh);
-	add_request_rec_fh("path", path_fh);
-	add_request_rec_fh("path_info", path_info_fh);
-	add_request_rec_fh("args", args_fh);
-	add_request_rec_fh("body", body_fh);
-	add_request_rec_fh("method", method_fh);
-	add_request_rec_fh("status", status_fh);
-	add_request_rec_fh("env", env_fh);
-	add_request_rec_fh("headers_in", headers_in_fh);
-	add_request_rec_fh("headers_out", headers_out_fh);
-	add_request_rec_fh("err_headers_out", err_headers_out_fh);
-	add_request_rec_fh("filename", filename_fh);
-	add_request_rec_fh("filedir", filedir_fh);
-	add_request_rec_fh("user", user_fh);
-	add_request_rec_fh("auth_type", auth_type_fh);
-	add_request_rec_fh("local_ip", local_ip_fh);
-	add_request_rec_fh("remote_ip", remote_ip_fh);
+static const request_rec_field request_rec_fields[] = {
+	{ "uri", 3, uri_fh, 1 },
+	{ "protocol", 8, protocol_fh, 1 },
+	{ "hostname", 8, hostname_fh, 1 },
+	{ "path", 4, path_fh, 1 },
+	{ "path_info", 9, path_info_fh, 1 },
+	{ "args", 4, args_fh, 1 },
+	{ "body", 4, body_fh, 1 },
+	{ "json", 4, json_fh, 1 },
+	{ "method", 6, method_fh, 1 },
+	{ "status", 6, status_fh, 0 },
+	{ "env", 3, env_fh, 1 },
+	{ "headers_in", 10, headers_in_fh, 1 },
+	{ "headers_out", 11, headers_out_fh, 1 },
+	{ "err_headers_out", 15, err_headers_out_fh, 1 },
+	{ "filename", 8, filename_fh, 1 },
+	{ "filedir", 7, filedir_fh, 1 },
+	{ "user", 4, user_fh, 1 },
+	{ "auth_type", 9, auth_type_fh, 1 },
+	{ "local_ip", 8, local_ip_fh, 1 },
+	{ "remote_ip", 9, remote_ip_fh, 1 },
 #if AP_SERVER_MAJORVERSION_NUMBER >= 2 && AP_SERVER_MINORVERSION_NUMBER >= 4
-	add_request_rec_fh("useragent_ip", useragent_ip_fh);
+	{ "useragent_ip", 12, useragent_ip_fh, 1 }
 #endif
+};
+
+static const request_rec_field *get_request_rec_field (const char *name,
+		size_t len) {
+	int i;
+
+	/* select the candidate by length and first character */
+	i = -1;
+	switch (len) {
+	case 3:
+		switch (name[0]) {
+		case 'u': i = FIELD_URI; break;
+		case 'e': i = FIELD_ENV; break;
+		}
+		break;
+
+	case 4:
+		switch (name[0]) {
+		case 'p': i = FIELD_PATH; break;
+		case 'a': i = FIELD_ARGS; break;
+		case 'b': i = FIELD_BODY; break;
+		case 'j': i = FIELD_JSON; break;
+		case 'u': i = FIELD_USER; break;
+		}
+		break;
+
+	case 6:
+		switch (name[0]) {
+		case 'm': i = FIELD_METHOD; break;
+		case 's': i = FIELD_STATUS; break;
+		}
+		break;
+
+	case 7:
+		i = FIELD_FILEDIR;
+		break;
+
+	case 8:
+		switch (name[0]) {
+		case 'p': i = FIELD_PROTOCOL; break;
+		case 'h': i = FIELD_HOSTNAME; break;
+		case 'f': i = FIELD_FILENAME; break;
+		case 'l': i = FIELD_LOCAL_IP; break;
+		}
+		break;
+
+	case 9:
+		switch (name[0]) {
+		case 'p': i = FIELD_PATH_INFO; break;
+		case 'a': i = FIELD_AUTH_TYPE; break;
+		case 'r': i = FIELD_REMOTE_IP; break;
+		}
+		break;
+
+	case 10:
+		i = FIELD_HEADERS_IN;
+		break;
+
+	case 11:
+		i = FIELD_HEADERS_OUT;
+		break;
+
+	case 12:
+		i = FIELD_USERAGENT_IP;
+		break;
+
+	case 15:
+		i = FIELD_ERR_HEADERS_OUT;
+		break;
+	}
+
+	/* the field may be compiled out */
+	if (i < 0 || i >= (int) (sizeof(request_rec_fields)
+			/ sizeof(request_rec_fields[0]))
+			|| memcmp(request_rec_fields[i].name, name, len) != 0) {
+		return NULL;
+	}
+	return &request_rec_fields[i];
 }
 
 /*
@@ -445,6 +654,136 @@ static int apr_table_pairs (lua_State *L) {
 	return 2;
 }
 
+/*
+ * Returns whether the first argument holds undecoded request arguments.
+ */
+static int is_args (lua_State *L) {
+	int result;
+
+	result = 0;
+	if (lua_getmetatable(L, 1)) {
+		luaL_getmetatable(L, LWT_APACHE_ARGS_METATABLE);
+		result = lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+	}
+	return result;
+}
+
+/*
+ * Decodes the request arguments of an args userdata and turns it into a
+ * regular APR table.
+ */
+static void decode_args (lua_State *L) {
+	apr_table_t **args;
+
+	args = (apr_table_t **) luaL_checkudata(L, 1,
+			LWT_APACHE_ARGS_METATABLE);
+	*args = get_args(L, get_lwt_request_rec(L));
+	luaL_getmetatable(L, LWT_APACHE_APR_TABLE_METATABLE);
+	lua_setmetatable(L, 1);
+}
+
+/*
+ * Provides the index metamethod for undecoded request arguments.
+ */
+static int args_index (lua_State *L) {
+	decode_args(L);
+	return apr_table_index(L);
+}
+
+/*
+ * Provides the newindex metamethod for undecoded request arguments.
+ */
+static int args_newindex (lua_State *L) {
+	decode_args(L);
+	return apr_table_newindex(L);
+}
+
+/*
+ * Returns the string representation of undecoded request arguments.
+ */
+static int args_tostring (lua_State *L) {
+	decode_args(L);
+	return apr_table_tostring(L);
+}
+
+/*
+ * Provides the iterator for request arguments and APR tables.
+ */
+static int args_pairs (lua_State *L) {
+	if (is_args(L)) {
+		decode_args(L);
+	}
+	return apr_table_pairs(L);
+}
+
+/*
+ * Returns an APR table, or request arguments, as a Lua table. Values of
+ * repeated keys are collected in an array. Optionally, keys are converted to
+ * lower case, which is useful for headers.
+ */
+static int totable (lua_State *L) {
+	apr_table_t *t;
+	int lower, i;
+	const apr_array_header_t *a;
+	const apr_table_entry_t *e;
+	char *key;
+
+	if (is_args(L)) {
+		decode_args(L);
+	}
+	t = *((apr_table_t **) luaL_checkudata(L, 1,
+			LWT_APACHE_APR_TABLE_METATABLE));
+	lower = lua_toboolean(L, 2);
+	a = apr_table_elts(t);
+	e = (const apr_table_entry_t *) a->elts;
+	lua_createtable(L, 0, a->nelts);
+	for (i = 0; i < a->nelts; i++) {
+		if (!e[i].key || !e[i].val) {
+			continue;
+		}
+		if (lower) {
+			key = apr_pstrdup(get_request_rec(L)->pool, e[i].key);
+			ap_str_tolower(key);
+			lua_pushstring(L, key);
+		} else {
+			lua_pushstring(L, e[i].key);
+		}
+		lua_pushvalue(L, -1);
+		lua_rawget(L, -3);
+		switch (lua_type(L, -1)) {
+		case LUA_TNIL:
+			/* first value */
+			lua_pop(L, 1);
+			lua_pushstring(L, e[i].val);
+			lua_rawset(L, -3);
+			break;
+
+		case LUA_TSTRING:
+			/* second value; convert to array */
+			lua_createtable(L, 2, 0);
+			lua_insert(L, -2);
+			lua_rawseti(L, -2, 1);
+			lua_pushstring(L, e[i].val);
+			lua_rawseti(L, -2, 2);
+			lua_rawset(L, -3);
+			break;
+
+		default:
+			/* further values */
+			lua_pushstring(L, e[i].val);
+			#if LUA_VERSION_NUM >= 502
+			lua_rawseti(L, -2, (int) lua_rawlen(L, -2) + 1);
+			#else
+			lua_rawseti(L, -2, (int) lua_objlen(L, -2) + 1);
+			#endif
+			lua_pop(L, 2);
+		}
+	}
+
+	return 1;
+}
+
 /*
  * Sets the abort flag of an LWT request.
  */
@@ -508,27 +847,64 @@ static int add_header (lua_State *L) {
 	return 0;
 }
 
+/*
+ * Hexadecimal digits for entity tags.
+ */
+static const char etag_hexdigits[] = "0123456789abcdef";
+
+/*
+ * Sets a strong entity tag from a digest and returns the result of evaluating
+ * the request conditions.
+ */
+static int set_etag (lwt_request_rec *lr, const unsigned char *digest) {
+	char *etag;
+	int i;
+
+	etag = apr_palloc(lr->r->pool, 2 * APR_MD5_DIGESTSIZE + 3);
+	etag[0] = '"';
+	for (i = 0; i < APR_MD5_DIGESTSIZE; i++) {
+		etag[1 + 2 * i] = etag_hexdigits[digest[i] / 16];
+		etag[2 + 2 * i] = etag_hexdigits[digest[i] % 16];
+	}
+	etag[2 * APR_MD5_DIGESTSIZE + 1] = '"';
+	etag[2 * APR_MD5_DIGESTSIZE + 2] = '\0';
+	apr_table_setn(lr->r->headers_out, "ETag", etag);
+	lr->etag_set = 1;
+
+	return ap_meets_conditions(lr->r);
+}
+
 /*
  * Writes a template.
  */
 static int write_template (lua_State *L) {
 	const char *filename, *flags;
-	int return_output;
+	int return_output, conditional;
+	lwt_request_rec *lr;
 	request_rec *r;
-	FILE *f;
+	FILE *f, *out;
 	char *s;
 	size_t len;
 	apr_status_t status;
-	apr_array_header_t *t;
+	lwt_template_t *t;
 	const char *err;
+	unsigned char digest[APR_MD5_DIGESTSIZE];
+	int result;
 
 	filename = luaL_checkstring(L, 1);
 	flags = luaL_optstring(L, 2, NULL);
 	return_output = lua_isnoneornil(L, 3);
+	conditional = !return_output && flags != NULL
+			&& strchr(flags, 'c') != NULL;
 	r = get_request_rec(L);
 
-	/* acquire file pointer */
-	if (return_output) {
+	/* acquire file pointer; conditional output is rendered to memory */
+	out = NULL;
+	if (return_output || conditional) {
+		if (conditional) {
+			out = *(FILE **) luaL_checkudata(L, 3,
+					LUA_FILEHANDLE);
+		}
 		f = open_memstream(&s, &len); 
 		if (!f) {
 			luaL_error(L, "Error opening memory stream");
@@ -540,7 +916,7 @@ static int write_template (lua_State *L) {
 	/* parse and render */
 	if ((status = lwt_template_parse(filename, L, flags, r->pool, &t, &err))
 			!= APR_SUCCESS) {
-		if (return_output) {
+		if (return_output || conditional) {
 			fclose(f);
 			free(s);
 		}
@@ -548,9 +924,14 @@ static int write_template (lua_State *L) {
 	}
 	if ((status = lwt_template_render(t, L, r->pool, f, &err))
 			!= APR_SUCCESS) {
-		if (return_output) {
+		if (return_output || conditional) {
 			fclose(f);
 			free(s);
+		} else {
+			lr = get_lwt_request_rec(L);
+			if (lr && is_aborted(lr)) {
+				raise_aborted(L, lr);
+			}
 		}
 		luaL_error(L, "Error rendering template: %s", err);
 	}
@@ -558,55 +939,90 @@ static int write_template (lua_State *L) {
 	if (return_output) {
 		fclose(f);
 		lua_pushlstring(L, s, len);
+		free(s);
 		return 1;
+	} else if (conditional) {
+		/* validate unless the handler has set an entity tag */
+		fclose(f);
+		lr = get_lwt_request_rec(L);
+		result = OK;
+		if (!lr->etag_set) {
+			apr_md5(digest, s, len);
+			result = set_etag(lr, digest);
+		}
+		if (result == OK) {
+			fwrite(s, len, 1, out);
+		}
+		free(s);
+		if (is_aborted(lr)) {
+			raise_aborted(L, lr);
+		}
+		if (result != OK) {
+			lua_pushinteger(L, result);
+			return 1;
+		}
+		return 0;
 	} else {
+		lr = get_lwt_request_rec(L);
+		if (lr && is_aborted(lr)) {
+			raise_aborted(L, lr);
+		}
 		return 0;
 	}
 }
 
 /*
- * Escapes URI reserved and unsafe characters in a string.
+ * Pushes the string at index 1 escaped. The string itself is pushed if no
+ * character needs escaping.
  */
-static int escape_uri (lua_State *L) {
+static int push_escaped (lua_State *L, int kind) {
 	const char *s;
-	request_rec *r;
-	
-	s = luaL_checkstring(L, 1);
-	r = get_request_rec(L);
-
-	lua_pushstring(L, lwt_util_escape_uri(r->pool, s));
+	size_t len, pos;
+	char buf[LWT_UTIL_ESCAPE_MAX];
+	luaL_Buffer b;
+
+	/* find the first character to escape */
+	s = luaL_checklstring(L, 1, &len);
+	pos = lwt_util_escape_span(kind, s, len);
+	if (pos == len) {
+		lua_pushvalue(L, 1);
+		return 1;
+	}
 
+	/* escape the rest */
+	luaL_buffinit(L, &b);
+	luaL_addlstring(&b, s, pos);
+	while (pos < len) {
+		luaL_addlstring(&b, buf, lwt_util_escape_char(kind,
+				(unsigned char) s[pos], buf));
+		s += pos + 1;
+		len -= pos + 1;
+		pos = lwt_util_escape_span(kind, s, len);
+		luaL_addlstring(&b, s, pos);
+	}
+	luaL_pushresult(&b);
 	return 1;
 }
 
+/*
+ * Escapes URI reserved and unsafe characters in a string.
+ */
+static int escape_uri (lua_State *L) {
+	return push_escaped(L, LWT_UTIL_ESCAPE_URI);
+}
+
 /*
  * Escapes XML reseved characters in a string.
  */
 static int escape_xml (lua_State *L) {
-	const char *s;
-	request_rec *r;
-
-	s = luaL_checkstring(L, 1);
-	r = get_request_rec(L);
-
-	lua_pushstring(L, ap_escape_html(r->pool, s));
-
-	return 1;
+	return push_escaped(L, LWT_UTIL_ESCAPE_XML);
 }
 
 /*
  * Escapes JavaScript reserved characters in a string.
  */
 static int escape_js (lua_State *L) {
-	const char *s;
-	request_rec *r;
-	
-	s = luaL_checkstring(L, 1);
-	r = get_request_rec(L);
-
-	lua_pushstring(L, lwt_util_escape_js(r->pool, s));
-
-	return 1;
+	return push_escaped(L, LWT_UTIL_ESCAPE_JS);
 }
 
 /*
@@ -635,104 +1051,1436 @@ static int defer (lua_State *L) {
 }
 
 /**
- * Returns a value of a date.
+ * Returns a HTTP date.
  */
-static int datevalue (lua_State *L, const char *key) {
-	int value;
-
-	lua_getfield(L, -1, key);
-	if (lua_isnil(L, -1)) {
-		return luaL_error(L, "field " LUA_QS " missing", key);
-	}
-	value = lua_tonumber(L, -1);
-	lua_pop(L, 1);
-	return value;
-}
+static int httpdate (lua_State *L) {
+	lua_Number t;
+	char buf[APR_RFC822_DATE_LEN];
 
-/**
- * Returns a HTTP/GMT time from components.
- */
-static int httptime (lua_State *L) {
-	struct tm tm;
-	time_t t;
-
-	tm.tm_year = datevalue(L, "year") - 1900;
-	tm.tm_mon = datevalue(L, "month") - 1;
-	tm.tm_mday = datevalue(L, "day");
-	tm.tm_hour = datevalue(L, "hour");
-	tm.tm_min = datevalue(L, "min");
-	tm.tm_sec = datevalue(L, "sec");
-	tm.tm_isdst = -1;
-	t = timegm(&tm);
-	if (t == -1) {
+	if (lua_isnoneornil(L, 1)) {
 		lua_pushnil(L);
-	} else {
-		lua_pushnumber(L, t);
+		return 1;
 	}
+	t = luaL_checknumber(L, 1);
+	ap_recent_rfc822_date(buf, apr_time_from_sec((apr_time_t) floor(t)));
+	lua_pushstring(L, buf);
 	return 1;
 }
 
 /*
- * LWT functions
+ * Month names in HTTP dates.
  */
-static const luaL_Reg functions[] = {
-	{ "pairs", apr_table_pairs },
-	{ "set_abort", set_abort },
-	{ "set_status", set_status },
-	{ "set_content_type", set_content_type },
-	{ "add_header", add_header },
-	{ "write_template", write_template },
-	{ "escape_uri", escape_uri },
-	{ "escape_xml", escape_xml },
-	{ "escape_js", escape_js },
-	{ "defer", defer },
-	{ "time", httptime },
-	{ NULL, NULL }
-};
+static const char date_months[] = "janfebmaraprmayjunjulaugsepoctnovdec";
 
-/*
- * Logs a debug message.
+/**
+ * Skips whitespace in a date.
  */
-static int log_apache (lua_State *L) {
-	const char *s;
-	request_rec *r;
-	lua_Integer level;
+static const char *date_space (const char *s) {
+	while (apr_isspace(*s)) {
+		s++;
+	}
+	return s;
+}
 
-	s = luaL_checkstring(L, 1);
-	r = get_request_rec(L);
-	level = lua_tointeger(L, lua_upvalueindex(1));
+/**
+ * Parses a number of at least one and at most max digits in a date.
+ */
+static const char *date_number (const char *s, int max, int *value) {
+	int n;
 
-	ap_log_rerror(APLOG_MARK, level, 0, r, "%s", s);
+	*value = 0;
+	for (n = 0; n < max && apr_isdigit(s[n]); n++) {
+		*value = *value * 10 + (s[n] - '0');
+	}
+	return n > 0 && !apr_isdigit(s[n]) ? s + n : NULL;
+}
 
-	return 0;
+/**
+ * Parses a month name in a date.
+ */
+static const char *date_month (const char *s, int *month) {
+	char name[3];
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!apr_isalpha(s[i])) {
+			return NULL;
+		}
+		name[i] = apr_tolower(s[i]);
+	}
+	if (apr_isalpha(s[3])) {
+		return NULL;
+	}
+	for (i = 0; i < 12; i++) {
+		if (memcmp(name, &date_months[i * 3], 3) == 0) {
+			*month = i + 1;
+			return s + 3;
+		}
+	}
+	return NULL;
 }
 
-/*
- * Registers log.
+/**
+ * Parses the hh:mm:ss time of a date, including surrounding whitespace.
  */
-static void register_log (lua_State *L) {
-	lua_pushinteger(L, APLOG_DEBUG);
-	lua_pushcclosure(L, log_apache, 1);
-	lua_setfield(L, -2, "debug");
-	lua_pushinteger(L, APLOG_NOTICE);
-	lua_pushcclosure(L, log_apache, 1);
-	lua_setfield(L, -2, "notice");
-	lua_pushinteger(L, APLOG_ERR);
-	lua_pushcclosure(L, log_apache, 1);
-	lua_setfield(L, -2, "err");
+static const char *date_time (const char *s, int *hour, int *min, int *sec) {
+	if (!apr_isspace(*s)) {
+		return NULL;
+	}
+	s = date_space(s);
+	if (!(s = date_number(s, 2, hour)) || *s++ != ':'
+			|| !(s = date_number(s, 2, min)) || *s++ != ':'
+			|| !(s = date_number(s, 2, sec)) || !apr_isspace(*s)) {
+		return NULL;
+	}
+	return date_space(s);
 }
 
-/*
- * Cookie read function for Apache requests.
+/**
+ * Parses a HTTP date in RFC 1123, RFC 850 or asctime format. Returns 0 if
+ * the date is valid, and -1 otherwise.
  */
-static ssize_t cookie_read (void *cookie, char *buf, size_t size) {
-	lua_State *L;
-	lwt_request_rec *lr;
-	long read;
+static int date_parse (const char *s, apr_int64_t *t) {
+	int day, month, year, hour, min, sec;
+	apr_int64_t days;
 
-	L = (lua_State *) cookie;
-	lr = get_lwt_request_rec(L);
-	if (!lr) {
+	/* weekday */
+	s = date_space(s);
+	if (!apr_isalpha(*s)) {
+		return -1;
+	}
+	while (apr_isalpha(*s)) {
+		s++;
+	}
+
+	if (*s == ',') {
+		/* RFC 1123 "Sun, 06 Nov 1994" or RFC 850 "Sunday, 06-Nov-94" */
+		s++;
+		if (!apr_isspace(*s)) {
+			return -1;
+		}
+		s = date_space(s);
+		if (!(s = date_number(s, 2, &day))) {
+			return -1;
+		}
+		if (*s == '-') {
+			if (!(s = date_month(s + 1, &month)) || *s++ != '-'
+					|| !(s = date_number(s, 4, &year))) {
+				return -1;
+			}
+		} else {
+			if (!apr_isspace(*s)) {
+				return -1;
+			}
+			s = date_space(s);
+			if (!(s = date_month(s, &month)) || !apr_isspace(*s)) {
+				return -1;
+			}
+			s = date_space(s);
+			if (!(s = date_number(s, 4, &year))) {
+				return -1;
+			}
+		}
+		if (!(s = date_time(s, &hour, &min, &sec))
+				|| strncmp(s, "GMT", 3) != 0) {
+			return -1;
+		}
+		s += 3;
+	} else {
+		/* asctime "Sun Nov  6 08:49:37 1994" */
+		if (!apr_isspace(*s)) {
+			return -1;
+		}
+		s = date_space(s);
+		if (!(s = date_month(s, &month)) || !apr_isspace(*s)) {
+			return -1;
+		}
+		s = date_space(s);
+		if (!(s = date_number(s, 2, &day))
+				|| !(s = date_time(s, &hour, &min, &sec))
+				|| !(s = date_number(s, 4, &year))) {
+			return -1;
+		}
+	}
+	if (*date_space(s) != '\0') {
+		return -1;
+	}
+
+	/* two-digit years */
+	if (year < 100) {
+		year += year >= 70 ? 1900 : 2000;
+	}
+	if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60) {
+		return -1;
+	}
+
+	/* days since the epoch in the proleptic Gregorian calendar */
+	if (month <= 2) {
+		year--;
+	}
+	days = (apr_int64_t) year * 365 + year / 4 - year / 100 + year / 400
+			+ (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5
+			+ day - 1 - 719468;
+	*t = ((days * 24 + hour) * 60 + min) * 60 + sec;
+	return 0;
+}
+
+/**
+ * Parses a HTTP date and returns its time.
+ */
+static int httptime (lua_State *L) {
+	apr_int64_t t;
+
+	if (lua_isnoneornil(L, 1)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if (date_parse(luaL_checkstring(L, 1), &t) != 0) {
+		lua_pushnil(L);
+	} else {
+		lua_pushnumber(L, (lua_Number) t);
+	}
+	return 1;
+}
+
+/*
+ * Sets a strong entity tag based on a version key, and optionally the last
+ * modification time, and evaluates the request conditions.
+ */
+static int etag (lua_State *L) {
+	const char *key;
+	size_t len;
+	lua_Number mtime;
+	lwt_request_rec *lr;
+	unsigned char digest[APR_MD5_DIGESTSIZE];
+	int result;
+
+	key = luaL_checklstring(L, 1, &len);
+	mtime = luaL_optnumber(L, 2, -1);
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
+		luaL_error(L, "no request record");
+	}
+
+	/* set validators */
+	if (mtime >= 0) {
+		ap_update_mtime(lr->r, apr_time_from_sec((apr_time_t) mtime));
+		ap_set_last_modified(lr->r);
+	}
+	apr_md5(digest, key, len);
+	result = set_etag(lr, digest);
+
+	/* return status if the request need not be processed */
+	if (result != OK) {
+		lua_pushinteger(L, result);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Moves an uploaded file to its final location. The file is renamed, and
+ * copied only if the final location is on a different file system.
+ */
+static int move_upload (lua_State *L) {
+	const char *upload, *path;
+	lwt_request_rec *lr;
+	apr_status_t status;
+	char buf[256];
+
+	upload = luaL_checkstring(L, 1);
+	path = luaL_checkstring(L, 2);
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
+		luaL_error(L, "no request record");
+	}
+	get_args(L, lr);
+	if (!lr->uploads || !apr_table_get(lr->uploads, upload)) {
+		luaL_error(L, "no upload " LUA_QS, upload);
+	}
+
+	status = apr_file_rename(upload, path, lr->r->pool);
+	if (APR_STATUS_IS_EXDEV(status)) {
+		status = apr_file_copy(upload, path,
+				APR_FPROT_FILE_SOURCE_PERMS, lr->r->pool);
+	}
+	if (status != APR_SUCCESS) {
+		luaL_error(L, "error moving upload to " LUA_QS ": %s", path,
+				apr_strerror(status, buf, sizeof(buf)));
+	}
+	apr_table_unset(lr->uploads, upload);
+
+	return 0;
+}
+
+/*
+ * Writes strings to the response. The strings are passed to ap_rwrite
+ * directly, bypassing the stdio stream of the output file. Returns the output
+ * file, as its write method does.
+ */
+static int write_output (lua_State *L) {
+	lwt_request_rec *lr;
+	int i, n;
+	const char *s;
+	size_t len;
+
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
+		luaL_error(L, "no request record");
+	}
+	n = lua_gettop(L);
+	for (i = 1; i <= n; i++) {
+		s = luaL_checklstring(L, i, &len);
+		if (len == 0) {
+			continue;
+		}
+		if (lr->eos) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "Response already complete");
+			return 2;
+		}
+		lr->output_started = 1;
+		if (is_aborted(lr) || ap_rwrite(s, len, lr->r) < 0) {
+			raise_aborted(L, lr);
+		}
+	}
+	lua_pushvalue(L, lua_upvalueindex(1));
+
+	return 1;
+}
+
+/*
+ * WSAPI output state.
+ */
+typedef struct wsapi_output_rec {
+	int body;
+	char *line;
+	apr_size_t line_len;
+} wsapi_output_rec;
+
+/*
+ * Processes a WSAPI header line without line terminator. Returns 1 if the
+ * line terminates the headers, and 0 otherwise.
+ */
+static int wsapi_header (lua_State *L, request_rec *r, const char *line,
+		apr_size_t len) {
+	const char *colon, *value;
+	char *name;
+	apr_size_t name_len;
+	int status;
+
+	/* strip CR */
+	if (len > 0 && line[len - 1] == '\r') {
+		len--;
+	}
+	if (len == 0) {
+		return 1;
+	}
+
+	/* split */
+	colon = memchr(line, ':', len);
+	if (!colon || colon == line) {
+		luaL_error(L, "invalid WSAPI header line");
+	}
+	name_len = colon - line;
+	value = colon + 1;
+	while (value < line + len && (*value == ' ' || *value == '\t')) {
+		value++;
+	}
+
+	/* set */
+	if (name_len == 6 && strncasecmp(line, "Status", 6) == 0) {
+		status = atoi(value);
+		if (status < 100 || status > 599) {
+			luaL_error(L, "invalid status (expected [100,599], "
+					"got %d)", status);
+		}
+		r->status = status;
+	} else if (name_len == 12 && strncasecmp(line, "Content-Type", 12)
+			== 0) {
+		ap_set_content_type(r, apr_pstrndup(r->pool, value,
+				line + len - value));
+	} else {
+		name = apr_pstrndup(r->pool, line, name_len);
+		apr_table_addn(r->headers_out, name, apr_pstrndup(r->pool,
+				value, line + len - value));
+	}
+	return 0;
+}
+
+/*
+ * Writes to a WSAPI output. Headers are parsed incrementally, and body
+ * data is passed to Apache directly.
+ */
+static int wsapi_output_write (lua_State *L) {
+	wsapi_output_rec *o;
+	lwt_request_rec *lr;
+	const char *s, *nl;
+	size_t len, n;
+	int i, top;
+
+	o = (wsapi_output_rec *) luaL_checkudata(L, 1,
+			LWT_APACHE_WSAPI_OUTPUT_METATABLE);
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
+		luaL_error(L, "no request record");
+	}
+	top = lua_gettop(L);
+	for (i = 2; i <= top; i++) {
+		s = luaL_checklstring(L, i, &len);
+
+		/* headers */
+		while (!o->body && len > 0) {
+			nl = memchr(s, '\n', len);
+			n = nl ? (size_t) (nl - s) : len;
+			if (o->line_len > 0 || !nl) {
+				/* collect the partial line */
+				if (o->line_len + n > HUGE_STRING_LEN) {
+					luaL_error(L, "WSAPI header line too "
+							"long");
+				}
+				if (!o->line) {
+					o->line = apr_palloc(lr->r->pool,
+							HUGE_STRING_LEN);
+				}
+				memcpy(o->line + o->line_len, s, n);
+				o->line_len += n;
+				if (nl) {
+					o->body = wsapi_header(L, lr->r,
+							o->line, o->line_len);
+					o->line_len = 0;
+				}
+			} else {
+				o->body = wsapi_header(L, lr->r, s, n);
+			}
+			if (nl) {
+				n++;
+			}
+			s += n;
+			len -= n;
+		}
+
+		/* body */
+		if (len == 0) {
+			continue;
+		}
+		if (lr->eos) {
+			luaL_error(L, "response already complete");
+		}
+		lr->output_started = 1;
+		if (is_aborted(lr) || ap_rwrite(s, len, lr->r) < 0) {
+			raise_aborted(L, lr);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns a WSAPI output.
+ */
+static int wsapi_output (lua_State *L) {
+	wsapi_output_rec *o;
+
+	o = (wsapi_output_rec *) lua_newuserdata(L, sizeof(wsapi_output_rec));
+	memset(o, 0, sizeof(wsapi_output_rec));
+	luaL_getmetatable(L, LWT_APACHE_WSAPI_OUTPUT_METATABLE);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+/*
+ * Nanoseconds of the modification time of a file. Platforms with
+ * nanosecond timestamps define st_mtime as a macro for the seconds of the
+ * timespec; elsewhere, only the seconds are compared.
+ */
+#if defined(__APPLE__)
+#define CHUNK_MTIME_NSEC(st) ((long) (st).st_mtimespec.tv_nsec)
+#elif defined(st_mtime)
+#define CHUNK_MTIME_NSEC(st) ((long) (st).st_mtim.tv_nsec)
+#else
+#define CHUNK_MTIME_NSEC(st) 0L
+#endif
+
+/*
+ * Compiled chunk cache entry.
+ */
+typedef struct chunk_rec {
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+	ino_t ino;
+	char *buf;
+	size_t len;
+} chunk_rec;
+
+/*
+ * Compiled chunks by filename. Entries are allocated with malloc, and live
+ * for the lifetime of the process.
+ */
+static apr_hash_t *chunks;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *chunks_mutex;
+#endif
+
+/*
+ * Dump buffer.
+ */
+typedef struct chunk_dump_rec {
+	char *buf;
+	size_t len;
+	size_t size;
+} chunk_dump_rec;
+
+/*
+ * Collects a dumped chunk.
+ */
+static int chunk_writer (lua_State *L, const void *p, size_t sz, void *ud) {
+	chunk_dump_rec *d = ud;
+	char *buf;
+
+	if (d->len + sz > d->size) {
+		d->size = d->size * 2 > d->len + sz ? d->size * 2 : d->len + sz;
+		if (!(buf = realloc(d->buf, d->size))) {
+			return 1;
+		}
+		d->buf = buf;
+	}
+	memcpy(d->buf + d->len, p, sz);
+	d->len += sz;
+	return 0;
+}
+
+/*
+ * Loads a Lua file as a chunk. Compiled chunks are cached across requests and
+ * recompiled when the file changes.
+ */
+static int load_chunk (lua_State *L, const char *filename) {
+	struct stat st;
+	chunk_rec *c;
+	chunk_dump_rec d;
+	int status;
+
+	/* cached? */
+	if (!chunks || stat(filename, &st) != 0) {
+		return luaL_loadfile(L, filename);
+	}
+	#if APR_HAS_THREADS
+	apr_thread_mutex_lock(chunks_mutex);
+	#endif
+	c = apr_hash_get(chunks, filename, APR_HASH_KEY_STRING);
+	if (c && c->mtime == st.st_mtime
+			&& c->mtime_nsec == CHUNK_MTIME_NSEC(st)
+			&& c->size == st.st_size && c->ino == st.st_ino) {
+		status = luaL_loadbuffer(L, c->buf, c->len, filename);
+		#if APR_HAS_THREADS
+		apr_thread_mutex_unlock(chunks_mutex);
+		#endif
+		return status;
+	}
+	#if APR_HAS_THREADS
+	apr_thread_mutex_unlock(chunks_mutex);
+	#endif
+
+	/* compile and dump */
+	if ((status = luaL_loadfile(L, filename)) != 0) {
+		return status;
+	}
+	memset(&d, 0, sizeof(d));
+	if (lua_dump(L, chunk_writer, &d) != 0) {
+		free(d.buf);
+		return 0;
+	}
+
+	/* cache */
+	#if APR_HAS_THREADS
+	apr_thread_mutex_lock(chunks_mutex);
+	#endif
+	c = apr_hash_get(chunks, filename, APR_HASH_KEY_STRING);
+	if (!c) {
+		if ((c = calloc(1, sizeof(chunk_rec))) != NULL) {
+			apr_hash_set(chunks, strdup(filename),
+					APR_HASH_KEY_STRING, c);
+		}
+	}
+	if (c) {
+		free(c->buf);
+		c->mtime = st.st_mtime;
+		c->mtime_nsec = CHUNK_MTIME_NSEC(st);
+		c->size = st.st_size;
+		c->ino = st.st_ino;
+		c->buf = d.buf;
+		c->len = d.len;
+	} else {
+		free(d.buf);
+	}
+	#if APR_HAS_THREADS
+	apr_thread_mutex_unlock(chunks_mutex);
+	#endif
+
+	return 0;
+}
+
+/*
+ * Loads a Lua file as a function, using the compiled chunk cache.
+ */
+static int loadfile (lua_State *L) {
+	const char *filename;
+
+	filename = luaL_checkstring(L, 1);
+	if (load_chunk(L, filename) != 0) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+
+	return 1;
+}
+
+/*
+ * Flushes the response output to the client.
+ */
+static int flush_output (lua_State *L) {
+	lwt_request_rec *lr;
+
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
+		luaL_error(L, "no request record");
+	}
+	if (lr->eos) {
+		return 0;
+	}
+	fflush(*(FILE **) luaL_checkudata(L, lua_upvalueindex(1),
+			LUA_FILEHANDLE));
+	lr->output_started = 1;
+	if (is_aborted(lr) || ap_rflush(lr->r) < 0) {
+		raise_aborted(L, lr);
+	}
+
+	return 0;
+}
+
+/*
+ * Streaming response state.
+ */
+typedef struct stream_rec {
+	apr_bucket_brigade *bb;
+	apr_interval_time_t heartbeat;
+	apr_time_t last;
+} stream_rec;
+
+/*
+ * Default heartbeat interval of streaming responses, in seconds.
+ */
+#define STREAM_HEARTBEAT 15
+
+/*
+ * Returns the request and streaming response state of a stream method.
+ */
+static stream_rec *check_stream (lua_State *L, lwt_request_rec **lr) {
+	stream_rec *s;
+
+	s = (stream_rec *) luaL_checkudata(L, 1, LWT_APACHE_STREAM_METATABLE);
+	*lr = get_lwt_request_rec(L);
+	if (!*lr) {
+		luaL_error(L, "no request record");
+	}
+	if (!s->bb || (*lr)->eos) {
+		luaL_error(L, "stream closed");
+	}
+	return s;
+}
+
+/*
+ * Passes the stream brigade with a flush bucket to the output filters.
+ */
+static void stream_flush (lua_State *L, lwt_request_rec *lr, stream_rec *s) {
+	APR_BRIGADE_INSERT_TAIL(s->bb, apr_bucket_flush_create(
+			lr->r->connection->bucket_alloc));
+	if (is_aborted(lr) || ap_pass_brigade(lr->r->output_filters, s->bb)
+			!= APR_SUCCESS) {
+		apr_brigade_cleanup(s->bb);
+		raise_aborted(L, lr);
+	}
+	apr_brigade_cleanup(s->bb);
+	s->last = apr_time_now();
+}
+
+/*
+ * Writes data to a stream and flushes it.
+ */
+static int stream_write (lua_State *L) {
+	lwt_request_rec *lr;
+	stream_rec *s;
+	const char *data;
+	size_t len;
+	int i, n;
+
+	s = check_stream(L, &lr);
+	n = lua_gettop(L);
+	for (i = 2; i <= n; i++) {
+		data = luaL_checklstring(L, i, &len);
+		apr_brigade_write(s->bb, NULL, NULL, data, len);
+	}
+	stream_flush(L, lr, s);
+
+	return 0;
+}
+
+/*
+ * Writes a Server-Sent Events field, splitting the value into lines.
+ */
+static void stream_field (stream_rec *s, const char *name, const char *value,
+		size_t len) {
+	const char *end, *nl;
+
+	end = value + len;
+	do {
+		nl = memchr(value, '\n', end - value);
+		apr_brigade_puts(s->bb, NULL, NULL, name);
+		apr_brigade_write(s->bb, NULL, NULL, ": ", 2);
+		apr_brigade_write(s->bb, NULL, NULL, value, (nl ? nl : end)
+				- value);
+		apr_brigade_write(s->bb, NULL, NULL, "\n", 1);
+		if (nl) {
+			value = nl + 1;
+		}
+	} while (nl);
+}
+
+/*
+ * Sends a Server-Sent Event with data, and optionally an event type and
+ * identifier.
+ */
+static int stream_send (lua_State *L) {
+	lwt_request_rec *lr;
+	stream_rec *s;
+	const char *data, *event, *id;
+	size_t len, event_len, id_len;
+
+	s = check_stream(L, &lr);
+	data = luaL_checklstring(L, 2, &len);
+	event = luaL_optlstring(L, 3, NULL, &event_len);
+	id = luaL_optlstring(L, 4, NULL, &id_len);
+	if ((event && memchr(event, '\n', event_len))
+			|| (id && memchr(id, '\n', id_len))) {
+		luaL_error(L, "event type and identifier must not contain "
+				"line feeds");
+	}
+	if (event) {
+		stream_field(s, "event", event, event_len);
+	}
+	if (id) {
+		stream_field(s, "id", id, id_len);
+	}
+	stream_field(s, "data", data, len);
+	apr_brigade_write(s->bb, NULL, NULL, "\n", 1);
+	stream_flush(L, lr, s);
+
+	return 0;
+}
+
+/*
+ * Waits for a number of seconds, sending heartbeat comments to keep the
+ * connection open.
+ */
+static int stream_sleep (lua_State *L) {
+	lwt_request_rec *lr;
+	stream_rec *s;
+	apr_time_t now, until, next;
+
+	s = check_stream(L, &lr);
+	now = apr_time_now();
+	until = now + (apr_interval_time_t) (luaL_checknumber(L, 2)
+			* APR_USEC_PER_SEC);
+	while (now < until) {
+		next = s->heartbeat > 0 ? s->last + s->heartbeat : until;
+		if (next > until) {
+			next = until;
+		}
+		if (next > now) {
+			apr_sleep(next - now);
+		}
+		if (is_aborted(lr)) {
+			raise_aborted(L, lr);
+		}
+		now = apr_time_now();
+		if (s->heartbeat > 0 && now >= s->last + s->heartbeat) {
+			apr_brigade_write(s->bb, NULL, NULL, ":\n\n", 3);
+			stream_flush(L, lr, s);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Starts a streaming response. Output is sent unbuffered, and flushed on each
+ * write. The response is sent as Server-Sent Events unless another content
+ * type is specified.
+ */
+static int stream (lua_State *L) {
+	lwt_request_rec *lr;
+	request_rec *r;
+	const char *content_type;
+	lua_Number heartbeat;
+	stream_rec *s;
+
+	content_type = "text/event-stream";
+	heartbeat = STREAM_HEARTBEAT;
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_getfield(L, 1, "content_type");
+		if (!lua_isnil(L, -1)) {
+			content_type = luaL_checkstring(L, -1);
+		}
+		lua_getfield(L, 1, "heartbeat");
+		if (!lua_isnil(L, -1)) {
+			heartbeat = luaL_checknumber(L, -1);
+		}
+		lua_pop(L, 2);
+	}
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
+		luaL_error(L, "no request record");
+	}
+	if (lr->eos) {
+		luaL_error(L, "response already complete");
+	}
+	r = lr->r;
+
+	/* send any buffered output first */
+	fflush(*(FILE **) luaL_checkudata(L, lua_upvalueindex(1),
+			LUA_FILEHANDLE));
+
+	/* set up the response */
+	ap_set_content_type(r, apr_pstrdup(r->pool, content_type));
+	apr_table_setn(r->headers_out, "Cache-Control", "no-cache");
+	apr_table_unset(r->headers_out, "Content-Length");
+	apr_table_setn(r->subprocess_env, "no-gzip", "1");
+	lr->output_started = 1;
+
+	/* create stream */
+	s = (stream_rec *) lua_newuserdata(L, sizeof(stream_rec));
+	s->bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+	s->heartbeat = (apr_interval_time_t) (heartbeat * APR_USEC_PER_SEC);
+	s->last = apr_time_now();
+	luaL_getmetatable(L, LWT_APACHE_STREAM_METATABLE);
+	lua_setmetatable(L, -2);
+
+	/* send headers */
+	stream_flush(L, lr, s);
+
+	return 1;
+}
+
+/*
+ * Key identifying I/O wait yields.
+ */
+static char wait_key;
+
+/*
+ * Suspends the running handler until a file descriptor is ready for reading
+ * or writing, or a timeout expires. Returns whether the descriptor is ready.
+ */
+static int wait_io (lua_State *L) {
+	const char *events;
+
+	luaL_checkinteger(L, 1);
+	events = luaL_optstring(L, 2, "r");
+	if (events[strspn(events, "rw")] != '\0') {
+		luaL_argerror(L, 2, "invalid events");
+	}
+	luaL_optnumber(L, 3, -1);
+	lua_settop(L, 3);
+	lua_pushlightuserdata(L, &wait_key);
+	lua_insert(L, 1);
+
+	return lua_yield(L, 4);
+}
+
+/*
+ * Returns whether a yielded coroutine waits for I/O, and sets the poll
+ * descriptor and timeout of the wait.
+ */
+static int get_wait (lua_State *co, struct pollfd *pfd, int *timeout) {
+	const char *events;
+
+	if (lua_gettop(co) != 4 || lua_touserdata(co, 1) != &wait_key) {
+		return 0;
+	}
+	pfd->fd = (int) lua_tointeger(co, 2);
+	events = lua_isnil(co, 3) ? "r" : lua_tostring(co, 3);
+	pfd->events = (strchr(events, 'r') ? POLLIN : 0)
+			| (strchr(events, 'w') ? POLLOUT : 0);
+	pfd->revents = 0;
+	*timeout = lua_isnil(co, 4) || lua_tonumber(co, 4) < 0 ? -1
+			: (int) (lua_tonumber(co, 4) * 1000);
+	lua_settop(co, 0);
+	return 1;
+}
+
+/*
+ * Parallel task states.
+ */
+#define TASK_RUNNABLE 0
+#define TASK_WAITING 1
+#define TASK_DONE 2
+
+/*
+ * Parallel task.
+ */
+typedef struct task_rec {
+	lua_State *co;
+	int state;
+	int nargs;
+	struct pollfd pfd;
+	apr_time_t deadline;
+} task_rec;
+
+/*
+ * Runs functions concurrently, each in its own coroutine. While a function
+ * waits for I/O with httpd.wait, the others run, and the waits are served by
+ * a single poll. Returns the first result of each function. If a function
+ * raises an error, the error is propagated and the other functions are
+ * abandoned: their coroutines are never resumed, so they do not run to
+ * completion, and resources they hold are only released when collected.
+ */
+static int parallel (lua_State *L) {
+	task_rec *tasks, *t;
+	struct pollfd *pfds;
+	int n, i, pending, waiting, timeout, status, cnt;
+	apr_time_t now;
+
+	/* create tasks */
+	luaL_checktype(L, 1, LUA_TTABLE);
+	#if LUA_VERSION_NUM >= 502
+	n = (int) lua_rawlen(L, 1);
+	#else
+	n = (int) lua_objlen(L, 1);
+	#endif
+	luaL_checkstack(L, n + 4, "too many tasks");
+	tasks = (task_rec *) lua_newuserdata(L, n * sizeof(task_rec)
+			+ n * sizeof(struct pollfd));
+	pfds = (struct pollfd *) (tasks + n);
+	lua_createtable(L, n, 0);	/* threads */
+	lua_createtable(L, n, 0);	/* results */
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		if (!lua_isfunction(L, -1)) {
+			luaL_error(L, "bad task #%d (function expected)", i + 1);
+		}
+		t = &tasks[i];
+		t->co = lua_newthread(L);
+		lua_rawseti(L, -3, i + 1);
+		lua_xmove(L, t->co, 1);
+		t->state = TASK_RUNNABLE;
+		t->nargs = 0;
+	}
+
+	/* schedule */
+	pending = n;
+	while (pending > 0) {
+		/* resume runnable tasks */
+		for (i = 0; i < n; i++) {
+			t = &tasks[i];
+			if (t->state != TASK_RUNNABLE) {
+				continue;
+			}
+			status = lua_resume(t->co, L, t->nargs);
+			if (status == LUA_YIELD) {
+				if (!get_wait(t->co, &t->pfd, &timeout)) {
+					luaL_error(L, "attempt to yield from a "
+							"task outside httpd.wait");
+				}
+				t->deadline = timeout >= 0 ? apr_time_now()
+						+ apr_time_from_msec(timeout)
+						: -1;
+				t->state = TASK_WAITING;
+			} else if (status == 0) {
+				lua_settop(t->co, 1);
+				lua_xmove(t->co, L, 1);
+				lua_rawseti(L, -2, i + 1);
+				t->state = TASK_DONE;
+				pending--;
+			} else {
+				lua_xmove(t->co, L, 1);
+				return lua_error(L);
+			}
+		}
+		if (pending == 0) {
+			break;
+		}
+
+		/* wait for any task */
+		now = apr_time_now();
+		timeout = -1;
+		waiting = 0;
+		for (i = 0; i < n; i++) {
+			t = &tasks[i];
+			if (t->state != TASK_WAITING) {
+				continue;
+			}
+			pfds[waiting++] = t->pfd;
+			if (t->deadline >= 0) {
+				/* round up to avoid spinning */
+				cnt = t->deadline > now ? (int) apr_time_as_msec(
+						t->deadline - now + 999) : 0;
+				if (timeout < 0 || cnt < timeout) {
+					timeout = cnt;
+				}
+			}
+		}
+		do {
+			cnt = poll(pfds, waiting, timeout);
+		} while (cnt < 0 && errno == EINTR);
+		if (cnt < 0) {
+			luaL_error(L, "Error waiting for tasks: %s",
+					strerror(errno));
+		}
+
+		/* make ready and timed out tasks runnable */
+		now = apr_time_now();
+		waiting = 0;
+		for (i = 0; i < n; i++) {
+			t = &tasks[i];
+			if (t->state != TASK_WAITING) {
+				continue;
+			}
+			t->pfd.revents = pfds[waiting++].revents;
+			if (t->pfd.revents != 0 || (t->deadline >= 0
+					&& now >= t->deadline)) {
+				lua_pushboolean(t->co, t->pfd.revents != 0);
+				t->nargs = 1;
+				t->state = TASK_RUNNABLE;
+			}
+		}
+	}
+
+	/* return results */
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, -1 - i, i + 1);
+	}
+
+	return n;
+}
+
+/*
+ * Sends a file, or a range of it, as part of the response. The file is
+ * passed to Apache in a file bucket, allowing for sendfile or mmap delivery.
+ * If nothing has been written before, the file completes the response: the
+ * content length and, for the whole file, the last modified time are set,
+ * and Apache serves Range requests.
+ */
+static int send_file (lua_State *L) {
+	const char *filename;
+	lua_Number offset, length;
+	lwt_request_rec *lr;
+	request_rec *r;
+	apr_file_t *f;
+	apr_finfo_t finfo;
+	apr_bucket_brigade *bb;
+	apr_status_t status;
+	char buf[256];
+
+	filename = luaL_checkstring(L, 1);
+	offset = luaL_optnumber(L, 2, 0);
+	length = luaL_optnumber(L, 3, -1);
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
+		luaL_error(L, "no request record");
+	}
+	if (lr->eos) {
+		luaL_error(L, "response already complete");
+	}
+	r = lr->r;
+
+	/* open file */
+	if ((status = apr_file_open(&f, filename, APR_FOPEN_READ
+			| APR_FOPEN_BINARY | APR_FOPEN_SENDFILE_ENABLED,
+			APR_OS_DEFAULT, r->pool)) != APR_SUCCESS
+			|| (status = apr_file_info_get(&finfo, APR_FINFO_SIZE
+			| APR_FINFO_MTIME, f)) != APR_SUCCESS) {
+		luaL_error(L, "Error opening file " LUA_QS ": %s", filename,
+				apr_strerror(status, buf, sizeof(buf)));
+	}
+	if (offset < 0 || offset > finfo.size) {
+		luaL_error(L, "offset out of range");
+	}
+	if (length < 0) {
+		length = finfo.size - offset;
+	} else if (offset + length > finfo.size) {
+		luaL_error(L, "length out of range");
+	}
+
+	/* pass file bucket */
+	bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+	if (length > 0) {
+		apr_brigade_insert_file(bb, f, (apr_off_t) offset,
+				(apr_off_t) length, r->pool);
+	}
+	if (!lr->output_started) {
+		ap_set_content_length(r, (apr_off_t) length);
+		if (offset == 0 && length == finfo.size) {
+			ap_update_mtime(r, finfo.mtime);
+			ap_set_last_modified(r);
+		}
+		APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(
+				r->connection->bucket_alloc));
+		lr->eos = 1;
+	}
+	lr->output_started = 1;
+	if (is_aborted(lr) || ap_pass_brigade(r->output_filters, bb)
+			!= APR_SUCCESS) {
+		raise_aborted(L, lr);
+	}
+	lua_pushboolean(L, 1);
+
+	return 1;
+}
+
+/*
+ * Returns whether a character is valid in a cookie name (RFC 2616 token).
+ */
+static int is_cookie_name_char (unsigned char c) {
+	return c > 32 && c < 127 && !strchr("()<>@,;:\\\"/[]?={}", c);
+}
+
+/*
+ * Returns whether a character is valid in a cookie value (RFC 6265
+ * cookie-octet).
+ */
+static int is_cookie_value_char (unsigned char c) {
+	return c == 0x21 || (c >= 0x23 && c <= 0x2b) || (c >= 0x2d
+			&& c <= 0x3a) || (c >= 0x3c && c <= 0x5b) || (c >= 0x5d
+			&& c <= 0x7e);
+}
+
+/*
+ * Pushes the request cookies. The cookies are parsed once per request and
+ * cached in the registry. If a cookie is repeated, the first value is used.
+ */
+static void push_cookies (lua_State *L, request_rec *r) {
+	const apr_array_header_t *a;
+	const apr_table_entry_t *e;
+	const char *pos, *name, *value;
+	int i;
+
+	/* cached? */
+	lua_getfield(L, LUA_REGISTRYINDEX, LWT_APACHE_COOKIES);
+	if (!lua_isnil(L, -1)) {
+		return;
+	}
+	lua_pop(L, 1);
+
+	/* parse cookie headers */
+	lua_newtable(L);
+	a = apr_table_elts(r->headers_in);
+	e = (const apr_table_entry_t *) a->elts;
+	for (i = 0; i < a->nelts; i++) {
+		if (!e[i].key || !e[i].val || strcasecmp(e[i].key, "Cookie")
+				!= 0) {
+			continue;
+		}
+		pos = e[i].val;
+		while (*pos) {
+			/* name */
+			while (*pos && !is_cookie_name_char(*pos)) {
+				pos++;
+			}
+			name = pos;
+			while (is_cookie_name_char(*pos)) {
+				pos++;
+			}
+			if (*pos != '=' || pos == name) {
+				continue;
+			}
+			lua_pushlstring(L, name, pos - name);
+			pos++;
+
+			/* value, optionally quoted */
+			if (*pos == '"') {
+				pos++;
+			}
+			value = pos;
+			while (is_cookie_value_char(*pos)) {
+				pos++;
+			}
+			if (pos == value) {
+				lua_pop(L, 1);
+				continue;
+			}
+
+			/* set unless repeated */
+			lua_pushvalue(L, -1);
+			lua_rawget(L, -3);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_pushlstring(L, value, pos - value);
+				lua_rawset(L, -3);
+			} else {
+				lua_pop(L, 2);
+			}
+		}
+	}
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWT_APACHE_COOKIES);
+}
+
+/*
+ * Returns a cookie value, or a table of all cookies if no name is passed.
+ */
+static int cookie (lua_State *L) {
+	const char *name;
+
+	name = luaL_optstring(L, 2, NULL);
+	push_cookies(L, get_request_rec(L));
+	if (name) {
+		lua_getfield(L, -1, name);
+	}
+
+	return 1;
+}
+
+/*
+ * Adds a cookie. The Set-Cookie header is built in a single allocation.
+ */
+static int add_cookie (lua_State *L) {
+	const char *name, *value, *path, *domain;
+	size_t name_len, value_len, path_len, domain_len, len, i;
+	lua_Number expires;
+	int secure, httponly;
+	request_rec *r;
+	char *header, *pos;
+
+	name = luaL_checklstring(L, 1, &name_len);
+	value = luaL_optlstring(L, 2, "", &value_len);
+	expires = luaL_optnumber(L, 3, -1);
+	path = luaL_optlstring(L, 4, NULL, &path_len);
+	domain = luaL_optlstring(L, 5, NULL, &domain_len);
+	secure = lua_toboolean(L, 6);
+	httponly = lua_toboolean(L, 7);
+	r = get_request_rec(L);
+
+	/* check name and value */
+	if (name_len == 0) {
+		luaL_error(L, "bad name");
+	}
+	for (i = 0; i < name_len; i++) {
+		if (!is_cookie_name_char(name[i])) {
+			luaL_error(L, "bad name");
+		}
+	}
+	for (i = 0; i < value_len; i++) {
+		if (!is_cookie_value_char(value[i])) {
+			luaL_error(L, "bad value");
+		}
+	}
+
+	/* make cookie */
+	len = name_len + 1 + value_len;
+	if (expires >= 0) {
+		len += sizeof("; Expires=") - 1 + APR_RFC822_DATE_LEN - 1;
+	}
+	if (path) {
+		len += sizeof("; Path=") - 1 + path_len;
+	}
+	if (domain) {
+		len += sizeof("; Domain=") - 1 + domain_len;
+	}
+	if (secure) {
+		len += sizeof("; Secure") - 1;
+	}
+	if (httponly) {
+		len += sizeof("; HttpOnly") - 1;
+	}
+	header = apr_palloc(r->pool, len + 1);
+	pos = header;
+	memcpy(pos, name, name_len);
+	pos += name_len;
+	*pos++ = '=';
+	memcpy(pos, value, value_len);
+	pos += value_len;
+	if (expires >= 0) {
+		memcpy(pos, "; Expires=", sizeof("; Expires=") - 1);
+		pos += sizeof("; Expires=") - 1;
+		apr_rfc822_date(pos, apr_time_from_sec((apr_time_t) expires));
+		pos += strlen(pos);
+	}
+	if (path) {
+		memcpy(pos, "; Path=", sizeof("; Path=") - 1);
+		pos += sizeof("; Path=") - 1;
+		memcpy(pos, path, path_len);
+		pos += path_len;
+	}
+	if (domain) {
+		memcpy(pos, "; Domain=", sizeof("; Domain=") - 1);
+		pos += sizeof("; Domain=") - 1;
+		memcpy(pos, domain, domain_len);
+		pos += domain_len;
+	}
+	if (secure) {
+		memcpy(pos, "; Secure", sizeof("; Secure") - 1);
+		pos += sizeof("; Secure") - 1;
+	}
+	if (httponly) {
+		memcpy(pos, "; HttpOnly", sizeof("; HttpOnly") - 1);
+		pos += sizeof("; HttpOnly") - 1;
+	}
+	*pos = '\0';
+
+	/* add header */
+	apr_table_addn(r->err_headers_out, "Set-Cookie", header);
+
+	return 0;
+}
+
+/*
+ * Decodes a JSON text.
+ */
+static int json_decode (lua_State *L) {
+	const char *s;
+	size_t len;
+	const char *err;
+
+	s = luaL_checklstring(L, 1, &len);
+	if (lwt_json_decode(L, s, len, get_request_rec(L)->pool, &err)
+			!= APR_SUCCESS) {
+		luaL_error(L, "Error decoding JSON: %s", err);
+	}
+
+	return 1;
+}
+
+/*
+ * Encodes a value as JSON. The JSON text is returned, or written to a file
+ * if one is passed. The text is encoded in memory and written as a whole, as
+ * the request output is unbuffered.
+ */
+static int json_encode (lua_State *L) {
+	lwt_request_rec *lr;
+	request_rec *r;
+	FILE *f, *out;
+	char *s;
+	size_t len;
+	const char *err;
+
+	luaL_checkany(L, 1);
+	out = lua_isnoneornil(L, 2) ? NULL : *(FILE **) luaL_checkudata(L, 2,
+			LUA_FILEHANDLE);
+	r = get_request_rec(L);
+
+	/* encode */
+	f = open_memstream(&s, &len);
+	if (!f) {
+		luaL_error(L, "Error opening memory stream");
+	}
+	if (lwt_json_encode(L, 1, f, r->pool, &err) != APR_SUCCESS) {
+		fclose(f);
+		free(s);
+		luaL_error(L, "Error encoding JSON: %s", err);
+	}
+	fclose(f);
+
+	/* return or write */
+	if (!out) {
+		lua_pushlstring(L, s, len);
+		free(s);
+		return 1;
+	}
+	if ((len > 0 && fwrite(s, len, 1, out) != 1) || ferror(out)) {
+		free(s);
+		lr = get_lwt_request_rec(L);
+		if (lr && is_aborted(lr)) {
+			raise_aborted(L, lr);
+		}
+		luaL_error(L, "Error writing JSON: %s", strerror(errno));
+	}
+	free(s);
+	return 0;
+}
+
+/*
+ * Returns an iterator over the parts of a multipart/form-data post.
+ */
+static int parts (lua_State *L);
+
+/*
+ * LWT functions
+ */
+static const luaL_Reg functions[] = {
+	{ "pairs", args_pairs },
+	{ "totable", totable },
+	{ "set_abort", set_abort },
+	{ "set_status", set_status },
+	{ "set_content_type", set_content_type },
+	{ "add_header", add_header },
+	{ "write_template", write_template },
+	{ "escape_uri", escape_uri },
+	{ "escape_xml", escape_xml },
+	{ "escape_js", escape_js },
+	{ "defer", defer },
+	{ "date", httpdate },
+	{ "time", httptime },
+	{ "etag", etag },
+	{ "move_upload", move_upload },
+	{ "parts", parts },
+	{ "sendfile", send_file },
+	{ "wsapi_output", wsapi_output },
+	{ "loadfile", loadfile },
+	{ "wait", wait_io },
+	{ "parallel", parallel },
+	{ "cookie", cookie },
+	{ "add_cookie", add_cookie },
+	{ "json_decode", json_decode },
+	{ "json_encode", json_encode },
+	{ NULL, NULL }
+};
+
+/*
+ * Logs a debug message.
+ */
+static int log_apache (lua_State *L) {
+	const char *s;
+	request_rec *r;
+	lua_Integer level;
+
+	s = luaL_checkstring(L, 1);
+	r = get_request_rec(L);
+	level = lua_tointeger(L, lua_upvalueindex(1));
+
+	ap_log_rerror(APLOG_MARK, level, 0, r, "%s", s);
+
+	return 0;
+}
+
+/*
+ * Registers log.
+ */
+static void register_log (lua_State *L) {
+	lua_pushinteger(L, APLOG_DEBUG);
+	lua_pushcclosure(L, log_apache, 1);
+	lua_setfield(L, -2, "debug");
+	lua_pushinteger(L, APLOG_NOTICE);
+	lua_pushcclosure(L, log_apache, 1);
+	lua_setfield(L, -2, "notice");
+	lua_pushinteger(L, APLOG_ERR);
+	lua_pushcclosure(L, log_apache, 1);
+	lua_setfield(L, -2, "err");
+}
+
+/*
+ * Cookie read function for Apache requests.
+ */
+static ssize_t cookie_read (void *cookie, char *buf, size_t size) {
+	lua_State *L;
+	lwt_request_rec *lr;
+	long read;
+
+	L = (lua_State *) cookie;
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
 		errno = EBADFD;
 		return -1;
 	}
@@ -781,8 +2529,18 @@ static ssize_t cookie_write (void *cookie, const char *buf, size_t size) {
 		errno = EBADFD;
 		return -1;
 	}
-	
-	return ap_rwrite(buf, size, lr->r);
+	if (lr->eos) {
+		errno = EPIPE;
+		return -1;
+	}
+	lr->output_started = size > 0 || lr->output_started;
+	if (is_aborted(lr) || ap_rwrite(buf, size, lr->r) < 0) {
+		lr->aborted = 1;
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	return size;
 }
 
 /*
@@ -891,107 +2649,233 @@ static void register_filehandles (lua_State *L) {
 #endif
 
 /*
- * Reads the request body.
+ * Reads the request body. If the content length is known, the body is read
+ * into a single buffer of that size. Otherwise, the body buckets are set
+ * aside as they arrive and flattened into a single buffer at the end.
  */
-static apr_status_t read_request_body (char **body, apr_size_t limit,
-		request_rec *r) {
-	apr_size_t bufsize, new_bufsize, pos, read;
-	char *buf, *new_buf;
+static apr_status_t read_request_body (char **body, apr_size_t *len,
+		apr_size_t limit, request_rec *r) {
+	const char *content_length;
+	apr_off_t clength;
+	char *end, *buf;
+	apr_bucket_brigade *bb, *kept;
+	apr_bucket *e;
+	const char *data;
+	apr_size_t size, pos;
+	apr_status_t status;
+	int eos;
+
+	/* get content length */
+	clength = -1;
+	content_length = apr_table_get(r->headers_in, "Content-Length");
+	if (content_length && !apr_table_get(r->headers_in,
+			"Transfer-Encoding")) {
+		if (apr_strtoff(&clength, content_length, &end, 10)
+				!= APR_SUCCESS || *end != '\0' || clength < 0) {
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+					"Invalid request content length");
+			return APR_EGENERAL;
+		}
+		if ((apr_size_t) clength > limit) {
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+					"Request body too large");
+			return APR_EGENERAL;
+		}
+		limit = (apr_size_t) clength;
+	}
 
-	if (ap_setup_client_block(r, REQUEST_CHUNKED_DECHUNK) != OK) {
-		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-				"Error preparing to read request body");
-		return APR_EGENERAL;
+	/* read */
+	bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+	if (clength >= 0) {
+		buf = (char *) apr_palloc(r->pool, (apr_size_t) clength + 1);
+		kept = NULL;
+	} else {
+		buf = NULL;
+		kept = apr_brigade_create(r->pool,
+				r->connection->bucket_alloc);
 	}
-	if (ap_should_client_block(r)) {
-		bufsize = 8192;
-		buf = (char *) apr_palloc(r->pool, bufsize);
-		pos = 0;
-		do {
-			read = ap_get_client_block(r, buf + pos, bufsize - pos);
-			switch (read) {
-			case 0:
-				buf[pos] = '\0';
+	pos = 0;
+	eos = 0;
+	do {
+		if ((status = ap_get_brigade(r->input_filters, bb,
+				AP_MODE_READBYTES, APR_BLOCK_READ,
+				HUGE_STRING_LEN)) != APR_SUCCESS) {
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+					"Error reading request body");
+			return status;
+		}
+		for (e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb);
+				e = APR_BUCKET_NEXT(e)) {
+			if (APR_BUCKET_IS_EOS(e)) {
+				eos = 1;
 				break;
-
-			case -1:
-				ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+			}
+			if (APR_BUCKET_IS_METADATA(e)) {
+				continue;
+			}
+			if ((status = apr_bucket_read(e, &data, &size,
+					APR_BLOCK_READ)) != APR_SUCCESS) {
+				ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
 						"Error reading request body");
+				return status;
+			}
+			if (size > limit - pos) {
+				ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+						"Request body too large");
 				return APR_EGENERAL;
-			
-			default:
-				pos += read;
-				if (pos == bufsize) {
-					new_bufsize = bufsize * 2;
-					if (new_bufsize > limit) {
-						ap_log_rerror(APLOG_MARK,
-								APLOG_ERR, 0, r,
-								"Request body "
-								"too large");
-						return APR_EGENERAL;
-					}
-					new_buf = apr_palloc(r->pool,
-							new_bufsize);
-					memcpy(new_buf, buf, bufsize);
-					bufsize = new_bufsize;
-					buf = new_buf;
-				}
 			}
-		} while (read != 0);
-	} else {
-		buf = (char *) apr_palloc(r->pool, sizeof(char));
-		*buf = '\0';
+			if (buf) {
+				memcpy(buf + pos, data, size);
+			} else if ((status = apr_bucket_setaside(e, r->pool))
+					!= APR_SUCCESS) {
+				ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+						"Error reading request body");
+				return status;
+			}
+			pos += size;
+		}
+		if (kept) {
+			APR_BRIGADE_CONCAT(kept, bb);
+		} else {
+			apr_brigade_cleanup(bb);
+		}
+	} while (!eos);
+	apr_brigade_destroy(bb);
+
+	/* flatten */
+	if (kept) {
+		buf = (char *) apr_palloc(r->pool, pos + 1);
+		size = pos;
+		if ((status = apr_brigade_flatten(kept, buf, &size))
+				!= APR_SUCCESS || size != pos) {
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+					"Error reading request body");
+			return APR_EGENERAL;
+		}
+		apr_brigade_destroy(kept);
+	} else if (pos != (apr_size_t) clength) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+				"Unexpected end of request body");
+		return APR_EGENERAL;
 	}
+	buf[pos] = '\0';
 
 	*body = buf;
+	*len = pos;
 	return APR_SUCCESS;
 }
 
 /*
- * Deoodes URL encoded arguments.
+ * Counts the URL encoded arguments.
  */
-static apr_status_t decode_urlencoded (apr_table_t *args, char *urlencoded_args,
-		int maxargs, request_rec *r) {
-	char *tok, *last, *pos;
-	const char *sep = "&";
+static int count_urlencoded (const char *urlencoded_args, apr_size_t len) {
+	const char *pos, *end;
+	int cnt;
+
+	pos = urlencoded_args;
+	end = urlencoded_args + len;
+	cnt = len > 0;
+	while ((pos = memchr(pos, '&', end - pos)) != NULL) {
+		cnt++;
+		pos++;
+	}
+	return cnt;
+}
 
-	/* decode arguments */
-	tok = apr_strtok(urlencoded_args, sep, &last);
-	while (tok != NULL) {
-		/* check argument count */
-		if (apr_table_elts(args)->nelts + 1 > maxargs) {
-			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Too many "
-					"request arguments (maximum %d)",
-					maxargs);
-			return APR_EGENERAL;
+/*
+ * Decodes a hex digit.
+ */
+#define HEXVAL(c) (apr_isdigit(c) ? (c) - '0' : apr_toupper(c) - 'A' + 10)
+
+/*
+ * Deoodes URL encoded arguments. The arguments must be NUL-terminated and are
+ * not modified. Splitting, '+' replacement and unescaping happen in a single
+ * pass into one buffer holding all keys and values; runs without special
+ * characters are copied as a whole.
+ */
+static apr_status_t decode_urlencoded (apr_table_t *args,
+		const char *urlencoded_args, apr_size_t len, int maxargs,
+		request_rec *r) {
+	const char *pos, *end, *tok;
+	char *out, *key, *value;
+	apr_size_t n;
+	int cnt;
+
+	/* a decoded argument is never longer than its encoded form */
+	cnt = apr_table_elts(args)->nelts;
+	out = apr_palloc(r->pool, len + 1);
+	pos = urlencoded_args;
+	end = urlencoded_args + len;
+	tok = pos;
+	key = out;
+	value = NULL;
+	while (1) {
+		/* copy run without special characters */
+		n = strcspn(pos, "%+=&");
+		if (n > (apr_size_t) (end - pos)) {
+			n = end - pos;
 		}
-		
-		/* convert + to space (historical) */
-		pos = tok;
-		while (*pos) {
-			if (*pos == '+') {
-				*pos = ' ';
+		memcpy(out, pos, n);
+		out += n;
+		pos += n;
+
+		/* end of argument */
+		if (pos == end || *pos == '&') {
+			if (pos > tok) {
+				if (++cnt > maxargs) {
+					ap_log_rerror(APLOG_MARK, APLOG_ERR, 0,
+							r, "Too many request "
+							"arguments (maximum "
+							"%d)", maxargs);
+					return APR_EGENERAL;
+				}
+				*out++ = '\0';
+				apr_table_addn(args, key, value ? value : "");
+			}
+			if (pos == end) {
+				break;
 			}
 			pos++;
-		}	
+			tok = pos;
+			key = out;
+			value = NULL;
+			continue;
+		}
 
-		/* split on '=' */
-		pos = strchr(tok, '=');
-		if (pos != NULL) {
-			*pos = '\0';
+		/* special character */
+		switch (*pos) {
+		case '+':
+			/* convert + to space (historical) */
+			*out++ = ' ';
 			pos++;
-			ap_unescape_url(tok);
-			ap_unescape_url(pos);
-		} else {
-			ap_unescape_url(tok);
-			pos = "";
-		}
+			break;
+
+		case '%':
+			if (end - pos >= 3 && apr_isxdigit(pos[1])
+					&& apr_isxdigit(pos[2])) {
+				*out++ = (char) (HEXVAL(pos[1]) << 4
+						| HEXVAL(pos[2]));
+				pos += 3;
+			} else {
+				*out++ = *pos++;
+			}
+			break;
 
-		/* add in table */
-		apr_table_addn(args, tok, pos);
+		case '=':
+			/* split on the first '=' */
+			if (!value) {
+				*out++ = '\0';
+				value = out;
+			} else {
+				*out++ = '=';
+			}
+			pos++;
+			break;
 
-		/* next token */
-		tok = apr_strtok(NULL, sep, &last);
+		default:
+			/* embedded NUL */
+			*out++ = *pos++;
+		}
 	}
 
 	return APR_SUCCESS;
@@ -1013,6 +2897,7 @@ typedef struct multipart_rec {
 	apr_size_t fsize, flimit;
 	char *value;
 	apr_size_t vpos, vcapacity;
+	int in_part, parts;
 } multipart_rec;
 
 /*
@@ -1037,12 +2922,12 @@ static apr_status_t multipart_read (multipart_rec *m) {
  * Reads a line from the request.
  */
 static apr_status_t multipart_readline (multipart_rec *m) {
-	int cr;
+	char *nl;
+	apr_size_t cnt;
 	apr_status_t status;
 
-	cr = 0;
 	m->lpos = 0;
-	while (m->lpos < m->lcapacity) {
+	while (1) {
 		/* fill buffer */
 		if (m->bpos == m->blimit) {
 			m->bpos = 0;
@@ -1056,27 +2941,28 @@ static apr_status_t multipart_readline (multipart_rec *m) {
 			}
 		}
 
-		/* append */
-		m->line[m->lpos] = m->buf[m->bpos];
+		/* append up to and including the next LF */
+		nl = memchr(m->buf + m->bpos, '\n', m->blimit - m->bpos);
+		cnt = nl ? (apr_size_t) (nl - (m->buf + m->bpos)) + 1
+				: m->blimit - m->bpos;
+		if (cnt > m->lcapacity - m->lpos) {
+			/* line too long */
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, m->r,
+					"Line too long");
+			return APR_EGENERAL;
+		}
+		memcpy(m->line + m->lpos, m->buf + m->bpos, cnt);
+		m->lpos += cnt;
+		m->bpos += cnt;
 
 		/* find CRLF */
-		if (cr && m->line[m->lpos] == '\n') {
-			m->lpos--;
+		if (nl && m->lpos >= 2 && m->line[m->lpos - 2] == '\r') {
+			m->lpos -= 2;
 			m->line[m->lpos] = '\0';
 			m->llimit = m->lpos;
-			m->bpos++;
 			return APR_SUCCESS;
 		}
-		cr = m->line[m->lpos] == '\r';
-
-		/* next */
-		m->lpos++;
-		m->bpos++;
 	}
-
-	/* line too long */
-	ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, m->r, "Line too long");
-	return APR_EGENERAL;
 }
 
 /*
@@ -1265,6 +3151,65 @@ static apr_status_t multipart_process (multipart_rec *m) {
 	return APR_SUCCESS;
 }
 
+/*
+ * Finds the boundary in the buffer, starting at the current position. The
+ * boundary starts with CR, so candidates are located with memchr and then
+ * verified. A partial match can only occur at the end of the buffer. On
+ * return, the buffer position is at the (partial) match, or at the buffer
+ * limit if there is none, and the match length is set.
+ */
+static void multipart_find (multipart_rec *m) {
+	char *pos;
+	apr_size_t avail;
+
+	while (m->bpos < m->blimit) {
+		pos = memchr(m->buf + m->bpos, m->boundary[0], m->blimit
+				- m->bpos);
+		if (!pos) {
+			break;
+		}
+		m->bpos = pos - m->buf;
+		avail = m->blimit - m->bpos;
+		m->xpos = avail < m->xlimit ? avail : m->xlimit;
+		if (memcmp(pos, m->boundary, m->xpos) == 0) {
+			return;
+		}
+		m->bpos++;
+	}
+	m->bpos = m->blimit;
+	m->xpos = 0;
+}
+
+/*
+ * Marks the next chunk of multipart data, reading from the request as
+ * needed. The chunk extends from the mark to the position. The boundary is
+ * fully matched when the match length reaches the boundary length.
+ */
+static apr_status_t multipart_chunk (multipart_rec *m) {
+	apr_status_t status;
+
+	/* carry a partial boundary match over to the next read */
+	if (m->bpos + m->xpos == m->blimit) {
+		memmove(m->buf, m->buf + m->bpos, m->xpos);
+		m->bpos = m->xpos;
+		if ((status = multipart_read(m)) != APR_SUCCESS) {
+			return status;
+		}
+		if (m->bpos == m->blimit) {
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, m->r,
+					"Unexpected end of request body");
+			return APR_EGENERAL;
+		}
+		m->bpos = 0;
+	}
+
+	/* find boundary */
+	m->bmark = m->bpos;
+	multipart_find(m);
+
+	return APR_SUCCESS;
+}
+
 /*
  * Scans multipart data until a boundary is found.
  */
@@ -1272,118 +3217,188 @@ static apr_status_t multipart_scan (multipart_rec *m) {
 	apr_status_t status;
 
 	/* loop until the boundary is fully matched */
-	m->bmark = m->bpos;
-	m->xpos = 0;
-	while (1) {
-		while (m->bpos < m->blimit) {
-			if (m->buf[m->bpos] == m->boundary[m->xpos]) {
-				m->xpos++;
-				if (m->xpos == m->xlimit) {
-					m->bpos++;
-					break;
-				}
-			} else {
-				m->xpos = 0;
-				if (m->buf[m->bpos] == m->boundary[m->xpos]) {
-					m->xpos++;
-				}
-			}
-			m->bpos++;
+	do {
+		if ((status = multipart_chunk(m)) != APR_SUCCESS) {
+			return status;
 		}
-		if (m->xpos == 0) {
-			/* no boundary match */
-			if ((status = multipart_process(m)) != APR_SUCCESS) {
-				return status;
-			}
-			m->bmark = 0;
-			m->bpos = 0;
-		} else if (m->xpos < m->xlimit) {
-			/* partial boundary match */
-			m->bpos -= m->xpos;
-			if ((status = multipart_process(m)) != APR_SUCCESS) {					return status;
-			}
-			memmove(m->buf, m->buf + m->bpos, m->xpos);
-			m->bmark = 0;
-			m->bpos = m->xpos;
-		} else {
-			/* full boundary match */
-			m->bpos -= m->xpos;
-			if ((status = multipart_process(m)) != APR_SUCCESS) {
+		if ((status = multipart_process(m)) != APR_SUCCESS) {
+			return status;
+		}
+	} while (m->xpos != m->xlimit);
+
+	return APR_SUCCESS;
+}
+
+/*
+ * Prepares reading a multipart/form-data post up to the initial boundary.
+ */
+static apr_status_t multipart_init (multipart_rec **mp, request_rec *r) {
+	const char *content_type;
+	multipart_rec *m;
+	apr_status_t status;
+
+	/* anything to process? */
+	if (ap_setup_client_block(r, REQUEST_CHUNKED_DECHUNK) != OK) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+				"Error preparing to read request body");
+		return APR_EGENERAL;
+	}
+	if (!ap_should_client_block(r)) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No request body");
+		return APR_EGENERAL;
+	}
+
+	/* prepare multipart rec */
+	m = apr_pcalloc(r->pool, sizeof(multipart_rec));
+	m->r = r;
+	m->bcapacity = 65536;
+	m->buf = apr_palloc(r->pool, m->bcapacity);
+	m->lcapacity = 1024;
+	m->line = apr_palloc(r->pool, m->lcapacity);
+	
+	/* get boundary */
+	content_type = apr_table_get(r->headers_in, "Content-Type");
+	snprintf(m->line, m->lcapacity, "Content-Type: %s", content_type);
+	m->boundary = multipart_headerfield(m, "boundary");
+	if (!m->boundary) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No boundary");
+		return APR_EGENERAL;
+	}
+	m->boundary = apr_pstrcat(r->pool, "\r\n--", m->boundary, NULL);
+	m->xlimit = strlen(m->boundary);
+
+	/* read initial boundary */
+	if ((status = multipart_readline(m)) != APR_SUCCESS) {
+		return status;
+	}
+
+	*mp = m;
+	return APR_SUCCESS;
+}
+
+/*
+ * Advances to the next part and processes its headers. Any remaining data of
+ * the current part is skipped. If headers is not NULL, the part headers are
+ * added to it. Returns APR_EOF after the last part.
+ */
+static apr_status_t multipart_part (multipart_rec *m, apr_table_t *headers,
+		char **name, char **filename) {
+	apr_status_t status;
+	char *headername, *headervalue, *pos;
+
+	/* skip the current part and read the next boundary */
+	if (m->in_part) {
+		while (m->xpos != m->xlimit) {
+			if ((status = multipart_chunk(m)) != APR_SUCCESS) {
 				return status;
 			}
-			return APR_SUCCESS;
 		}
-	
-		/* read */
-		if ((status = multipart_read(m)) != APR_SUCCESS) {
+		m->in_part = 0;
+		m->bpos += 2;
+		if ((status = multipart_readline(m)) != APR_SUCCESS) {
 			return status;
 		}
-		if (m->bpos == m->blimit) {
-			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, m->r,
-					"Unexpected end of request body");
-			return APR_EGENERAL;
+	}
+
+	/* find final boundary */
+	if (strncmp(m->line, &m->boundary[2], m->xlimit - 2) != 0
+			|| strcmp(&m->line[m->xlimit - 2], "--") == 0) {
+		return APR_EOF;
+	}
+
+	/* process headers */
+	if ((status = multipart_readline(m)) != APR_SUCCESS) {
+		return status;
+	}	
+	headervalue = NULL;
+	*name = NULL;
+	*filename = NULL;
+	while (m->llimit > 0) {
+		headername = multipart_headername(m);
+		if (headername && strcasecmp(headername, "Content-Disposition")
+				== 0) {
+			headervalue = multipart_headervalue(m);
+			*name = multipart_headerfield(m, "name");
+			*filename = multipart_headerfield(m, "filename");
+		}
+		if (headername && headers) {
+			pos = index(m->line, ':') + 1;
+			while (isspace(*pos)) {
+				pos++;
+			}
+			apr_table_add(headers, headername, pos);
+		}
+
+		/* read next header */
+		if ((status = multipart_readline(m)) != APR_SUCCESS) {
+			return status;
 		}
 	}
+	if (!headervalue || strcasecmp(headervalue, "form-data") != 0) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, m->r, "No form data");
+		return APR_EGENERAL;
+	}
+	if (!*name) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, m->r, "No name");
+		return APR_EGENERAL;
+	}
+
+	/* prepare for the part data */
+	m->in_part = 1;
+	m->parts++;
+	m->xpos = 0;
+
+	return APR_SUCCESS;
 }
 
 /*
- * Reads a multipart/form-data post.
+ * Opens a temporary file for an upload. The file has a real path, so scripts
+ * can rename it, and is deleted when closed unless it has been moved.
  */
-static apr_status_t read_multipart (apr_table_t *args, int maxargs,
-		apr_size_t argslimit, apr_size_t filelimit, request_rec *r) {
-	const char *content_type;
-	multipart_rec *m;
-	apr_status_t status;
-	char *headername, *headervalue, *name, *filename;
-	size_t len;
+static apr_status_t multipart_open (multipart_rec *m, apr_table_t *uploads,
+		char **filename) {
 	const char *tempdir;
+	apr_status_t status;
 
-	/* anything to process? */
-	if (ap_setup_client_block(r, REQUEST_CHUNKED_DECHUNK) != OK) {
-		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-				"Error preparing to read request body");
-		return APR_EGENERAL;
+	if ((status = apr_temp_dir_get(&tempdir, m->r->pool)) != APR_SUCCESS) {
+		return status;
 	}
-	if (!ap_should_client_block(r)) {
-		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No request body");
-		return APR_EGENERAL;
+	if ((status = apr_filepath_merge(filename, tempdir, "lwt-XXXXXX", 0,
+			m->r->pool)) != APR_SUCCESS) {
+		return status;
+	}
+	if ((status = apr_file_mktemp(&m->F, *filename, APR_FOPEN_CREATE
+			| APR_FOPEN_WRITE | APR_FOPEN_DELONCLOSE, m->r->pool))
+			!= APR_SUCCESS) {
+		return status;
 	}
+	apr_table_setn(uploads, *filename, "file");
+	return APR_SUCCESS;
+}
+
+/*
+ * Reads a multipart/form-data post.
+ */
+static apr_status_t read_multipart (apr_table_t *args, apr_table_t *uploads,
+		int maxargs, apr_size_t argslimit, apr_size_t filelimit,
+		request_rec *r) {
+	multipart_rec *m;
+	apr_status_t status;
+	char *name, *filename;
+	size_t len;
 
 	/* prepare multipart rec */
-	m = apr_pcalloc(r->pool, sizeof(multipart_rec));
-	m->r = r;
-	m->bcapacity = 8192;
-	m->buf = apr_palloc(r->pool, m->bcapacity);
-	m->lcapacity = 1024;
-	m->line = apr_palloc(r->pool, m->lcapacity);
+	if ((status = multipart_init(&m, r)) != APR_SUCCESS) {
+		return status;
+	}
 	m->alimit = argslimit;
 	m->flimit = filelimit;
 	m->vcapacity = argslimit;
 	m->value = apr_palloc(r->pool, m->vcapacity);
-	
-	/* get boundary */
-	content_type = apr_table_get(r->headers_in, "Content-Type");
-	snprintf(m->line, m->lcapacity, "Content-Type: %s", content_type);
-	m->boundary = multipart_headerfield(m, "boundary");
-	if (!m->boundary) {
-		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No boundary");
-		return APR_EGENERAL;
-	}
-	m->boundary = apr_pstrcat(r->pool, "\r\n--", m->boundary, NULL);
-	m->xlimit = strlen(m->boundary);
-
-	/* read initial boundary */
-	if ((status = multipart_readline(m)) != APR_SUCCESS) {
-		return status;
-	}
 
 	/* process parts */
-	while (strncmp(m->line, &m->boundary[2], m->xlimit - 2) == 0) {
-		/* find final boundary */
-		if (strcmp(&m->line[m->xlimit - 2], "--") == 0) {
-			break;
-		}
-
+	while ((status = multipart_part(m, NULL, &name, &filename))
+			== APR_SUCCESS) {
 		/* check argument count */
 		if (apr_table_elts(args)->nelts + 1 > maxargs) {
 			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Too many "
@@ -1391,37 +3406,6 @@ static apr_status_t read_multipart (apr_table_t *args, int maxargs,
 					maxargs);
 			return APR_EGENERAL;
 		}
-
-		/* process headers */
-		if ((status = multipart_readline(m)) != APR_SUCCESS) {
-			return status;
-		}	
-		headervalue = NULL;
-		name = NULL;
-		filename = NULL;
-		while (m->llimit > 0) {
-			headername = multipart_headername(m);
-			if (strcasecmp(headername, "Content-Disposition")
-					== 0) {
-				headervalue = multipart_headervalue(m);
-				name = multipart_headerfield(m, "name");
-				filename = multipart_headerfield(m, "filename");
-			}
-
-			/* read mext jeader */
-			if ((status = multipart_readline(m)) != APR_SUCCESS) {
-				return status;
-			}
-		}
-		if (!headervalue || strcasecmp(headervalue, "form-data") != 0) {
-			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-					"No form data");
-			return APR_EGENERAL;
-		}
-		if (!name) {
-			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No name");
-			return APR_EGENERAL;
-		}
 		len = strlen(name);
 		if (m->asize + len > m->alimit) {
 			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
@@ -1433,18 +3417,7 @@ static apr_status_t read_multipart (apr_table_t *args, int maxargs,
 		/* setup */
 		if (filename) {
 			/* store in a temp file */
-			if ((status = apr_temp_dir_get(&tempdir, r->pool))
-					!= APR_SUCCESS) {
-				return status;
-			}
-			if ((status = apr_filepath_merge(&filename, tempdir,
-					"lwt-XXXXXX", 0, r->pool))
-					!= APR_SUCCESS) {
-				return status;
-			}
-			if ((status = apr_file_mktemp(&m->F, filename,
-					APR_FOPEN_CREATE | APR_FOPEN_WRITE
-					| APR_FOPEN_DELONCLOSE, r->pool))
+			if ((status = multipart_open(m, uploads, &filename))
 					!= APR_SUCCESS) {
 				return status;
 			}
@@ -1468,15 +3441,144 @@ static apr_status_t read_multipart (apr_table_t *args, int maxargs,
 		} else {
 			apr_table_add(args, name, m->value);
 		}
+	}
 
-		/* read next boundary */
-		m->bpos += 2;
-		if ((status = multipart_readline(m)) != APR_SUCCESS) {
-			return status;
+	return status == APR_EOF ? APR_SUCCESS : status;
+}
+
+/*
+ * Reads the next chunk of data of a multipart part.
+ */
+static int part_read (lua_State *L) {
+	lwt_request_rec *lr;
+	multipart_rec *m;
+
+	lr = get_lwt_request_rec(L);
+	m = lr ? lr->multipart : NULL;
+	if (!m || !m->in_part || m->parts != lua_tointeger(L,
+			lua_upvalueindex(1))) {
+		return 0;
+	}
+	while (m->xpos != m->xlimit) {
+		if (multipart_chunk(m) != APR_SUCCESS) {
+			luaL_error(L, "error reading multipart part");
+		}
+		if (m->bpos > m->bmark) {
+			lua_pushlstring(L, m->buf + m->bmark, m->bpos
+					- m->bmark);
+			return 1;
 		}
 	}
+	return 0;
+}
 
-	return APR_SUCCESS;
+/*
+ * Advances to the next part of a multipart/form-data post. Returns a table
+ * with the name, filename and headers of the part, and a function reading
+ * the part data chunk by chunk.
+ */
+static int parts_next (lua_State *L) {
+	lwt_request_rec *lr;
+	apr_table_t *headers;
+	char *name, *filename;
+	apr_status_t status;
+
+	lr = get_lwt_request_rec(L);
+	if (!lr || !lr->multipart) {
+		return 0;
+	}
+	headers = apr_table_make(lr->r->pool, 4);
+	status = multipart_part(lr->multipart, headers, &name, &filename);
+	if (status == APR_EOF) {
+		return 0;
+	}
+	if (status != APR_SUCCESS) {
+		luaL_error(L, "error reading multipart part");
+	}
+
+	/* push part */
+	lua_createtable(L, 0, 3);
+	lua_pushstring(L, name);
+	lua_setfield(L, -2, "name");
+	if (filename) {
+		lua_pushstring(L, filename);
+		lua_setfield(L, -2, "filename");
+	}
+	*((apr_table_t **) lua_newuserdata(L, sizeof(apr_table_t *)))
+			= headers;
+	luaL_getmetatable(L, LWT_APACHE_APR_TABLE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_setfield(L, -2, "headers");
+
+	/* push reader */
+	lua_pushinteger(L, lr->multipart->parts);
+	lua_pushcclosure(L, part_read, 1);
+
+	return 2;
+}
+
+static int parts (lua_State *L) {
+	lwt_request_rec *lr;
+	const char *content_type;
+
+	lr = get_lwt_request_rec(L);
+	if (!lr) {
+		luaL_error(L, "no request record");
+	}
+	if (!lr->multipart) {
+		content_type = apr_table_get(lr->r->headers_in,
+				"Content-Type");
+		if (!content_type || strcasecmp("multipart/form-data",
+				ap_field_noparam(lr->r->pool, content_type))
+				!= 0) {
+			luaL_error(L, "no multipart/form-data post");
+		}
+		if (lr->in_ready) {
+			luaL_error(L, "request input already read");
+		}
+		lr->in_ready = 1;
+		if (multipart_init(&lr->multipart, lr->r) != APR_SUCCESS) {
+			luaL_error(L, "error reading multipart/form-data "
+					"post");
+		}
+	}
+	lua_pushcfunction(L, parts_next);
+
+	return 1;
+}
+
+/*
+ * Replaces a string error message on top of the stack with a traceback of a
+ * coroutine.
+ */
+static void push_traceback (lua_State *L, lua_State *co) {
+	if (!lua_isstring(L, -1)) {
+		return;
+	}
+	#if LUA_VERSION_NUM >= 502
+	luaL_traceback(L, co, lua_tostring(L, -1), 0);
+	lua_remove(L, -2);
+	#else
+	/* get the traceback function from the debug module */
+	lua_getglobal(L, LUA_DBLIBNAME);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_getfield(L, -1, "traceback");
+	lua_remove(L, -2);
+	if (!lua_isfunction(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	/* call */
+	lua_pushthread(co);
+	lua_xmove(co, L, 1);
+	lua_pushvalue(L, -3);
+	lua_call(L, 2, 1);
+	lua_remove(L, -2);
+	#endif
 }
 
 /*
@@ -1484,7 +3586,108 @@ static apr_status_t read_multipart (apr_table_t *args, int maxargs,
  */
 
 void lwt_apache_init (apr_pool_t *pool) {
-	init_request_rec_fh(pool);
+	#if APR_HAS_THREADS
+	if (apr_thread_mutex_create(&chunks_mutex, APR_THREAD_MUTEX_DEFAULT,
+			pool) != APR_SUCCESS) {
+		return;
+	}
+	#endif
+	chunks = apr_hash_make(pool);
+}
+
+int lwt_apache_loadfile (lua_State *L, const char *filename) {
+	return load_chunk(L, filename);
+}
+
+/*
+ * Reads and decodes the request arguments from the query string and, for
+ * URL-encoded and multipart form data, the request body. The body is not
+ * decoded if the request input has already been read.
+ */
+static apr_status_t read_args (lwt_request_rec *lr, apr_table_t **args) {
+	request_rec *r;
+	apr_size_t argslimit;
+	size_t len;
+	int nargs;
+	apr_status_t status;
+	const char *content_type, *content_type_noparam;
+
+	/* check query string */
+	r = lr->r;
+	argslimit = lr->argslimit;
+	len = r->args ? strlen(r->args) : 0;
+	if (len > argslimit) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+				"GET arguments too large");
+		return APR_EGENERAL;
+	}
+	argslimit -= len;
+
+	/* read URL encoded body */
+	content_type = apr_table_get(r->headers_in, "Content-type");
+	content_type_noparam = content_type && !lr->in_ready
+			? ap_field_noparam(r->pool, content_type) : NULL;
+	if (content_type_noparam && strcasecmp(
+			"application/x-www-form-urlencoded",
+			content_type_noparam) == 0) {
+		if ((status = read_request_body(&lr->body, &lr->body_len,
+				argslimit, r)) != APR_SUCCESS) {
+			return status;
+		}
+		lr->in_ready = 1;
+	}
+
+	/* read JSON body; it is decoded when accessed */
+	if (content_type_noparam && strcasecmp("application/json",
+			content_type_noparam) == 0) {
+		if ((status = read_request_body(&lr->body, &lr->body_len,
+				argslimit, r)) != APR_SUCCESS) {
+			return status;
+		}
+		lr->in_ready = 1;
+		lr->body_json = 1;
+	}
+
+	/* decode URL encoded args */
+	nargs = r->args ? count_urlencoded(r->args, len) : 0;
+	if (lr->body && !lr->body_json) {
+		nargs += count_urlencoded(lr->body, lr->body_len);
+	}
+	*args = apr_table_make(r->pool, nargs < lr->maxargs ? nargs
+			: lr->maxargs);
+	if (r->args && (status = decode_urlencoded(*args, r->args, len,
+			lr->maxargs, r)) != APR_SUCCESS) {
+		return status;
+	}
+	if (lr->body && !lr->body_json && (status = decode_urlencoded(*args,
+			lr->body,
+			lr->body_len, lr->maxargs, r)) != APR_SUCCESS) {
+		return status;
+	}
+
+	/* read multipart body */
+	if (content_type_noparam && strcasecmp("multipart/form-data",
+			content_type_noparam) == 0) {
+		lr->uploads = apr_table_make(r->pool, 2);
+		if ((status = read_multipart(*args, lr->uploads, lr->maxargs,
+				argslimit, lr->filelimit, r)) != APR_SUCCESS) {
+			return status;
+		}
+		lr->in_ready = 1;
+	}
+
+	return APR_SUCCESS;
+}
+
+static apr_table_t *get_args (lua_State *L, lwt_request_rec *lr) {
+	if (!lr->args) {
+		if (lr->args_bad || read_args(lr, &lr->args) != APR_SUCCESS) {
+			lr->args = NULL;
+			lr->args_bad = 1;
+			luaL_error(L, "error decoding request arguments");
+		}
+	}
+	return lr->args;
 }
 
 apr_status_t lwt_apache_set_module_path (lua_State *L, const char *path,
@@ -1542,6 +3745,8 @@ apr_status_t lwt_apache_push_request_rec (lua_State *L,
 	lr->r = r;
 	luaL_getmetatable(L, LWT_APACHE_REQUEST_REC_METATABLE);
 	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
 	lua_pushvalue(L, -1);
 	lua_setfield(L, LUA_REGISTRYINDEX, LWT_APACHE_REQUEST_REC);
 
@@ -1550,58 +3755,17 @@ apr_status_t lwt_apache_push_request_rec (lua_State *L,
 
 apr_status_t lwt_apache_push_args (lua_State *L, request_rec *r, int maxargs,
 		apr_size_t argslimit, apr_size_t filelimit) {
-	apr_table_t *args;
-	size_t len;
-	char *urlencoded_args;
-	apr_status_t status;
-	const char *content_type, *content_type_noparam;
 	lwt_request_rec *lr;
 
-	/* extract args */
-	args = apr_table_make(r->pool, 4);
-	if (r->args != NULL) {
-		len = strlen(r->args);
-		if (len > argslimit) {
-			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-					"GET arguments too large");
-			return APR_EGENERAL;
-		}
-		urlencoded_args = apr_pstrdup(r->pool, r->args);
-		if ((status = decode_urlencoded(args, urlencoded_args, maxargs,
-				r)) != APR_SUCCESS) {
-			return status;
-		}
-		argslimit -= len;
-	}
-	content_type = apr_table_get(r->headers_in, "Content-type");
-	if (content_type) {
-		content_type_noparam = ap_field_noparam(r->pool, content_type);
-		if (strcasecmp("application/x-www-form-urlencoded",
-				content_type_noparam) == 0) {
-			if ((status = read_request_body(&urlencoded_args,
-					argslimit, r)) != APR_SUCCESS) {
-				return status;
-			}
-			lr = get_lwt_request_rec(L);
-			lr->in_ready = 1;
-			lr->body = apr_pstrdup(r->pool, urlencoded_args);
-			if ((status = decode_urlencoded(args, urlencoded_args,
-					maxargs, r)) != APR_SUCCESS) {
-				return status;
-			}
-		} else if (strcasecmp("multipart/form-data",
-				content_type_noparam) == 0) {
-			if ((status = read_multipart(args, maxargs, argslimit,
-					filelimit, r)) != APR_SUCCESS) {
-				return status;
-			}
-			get_lwt_request_rec(L)->in_ready = 1;
-		}
-	}
+	/* record limits; arguments are decoded on first access */
+	lr = get_lwt_request_rec(L);
+	lr->maxargs = maxargs;
+	lr->argslimit = argslimit;
+	lr->filelimit = filelimit;
 
 	/* push arguments */
-	*((apr_table_t **) lua_newuserdata(L, sizeof(apr_table_t *))) = args;
-	luaL_getmetatable(L, LWT_APACHE_APR_TABLE_METATABLE);
+	*((apr_table_t **) lua_newuserdata(L, sizeof(apr_table_t *))) = NULL;
+	luaL_getmetatable(L, LWT_APACHE_ARGS_METATABLE);
 	lua_setmetatable(L, -2);
 
 	return APR_SUCCESS;
@@ -1627,6 +3791,68 @@ int lwt_apache_is_abort (lua_State *L) {
 	return lr->abort;
 }
 
+int lwt_apache_run (lua_State *L, int nargs, int nresults) {
+	lua_State *co;
+	struct pollfd pfd;
+	int status, timeout, n;
+
+	/* move the function and its arguments to a new coroutine */
+	co = lua_newthread(L);
+	lua_insert(L, -(nargs + 2));
+	lua_xmove(L, co, nargs + 1);
+
+	/* resume until done, waiting for I/O as requested */
+	while ((status = lua_resume(co, L, nargs)) == LUA_YIELD) {
+		if (!get_wait(co, &pfd, &timeout)) {
+			lua_pop(L, 1);
+			lua_pushliteral(L, "attempt to yield from a handler "
+					"outside httpd.wait");
+			return LUA_ERRRUN;
+		}
+		do {
+			n = poll(&pfd, 1, timeout);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			lua_pop(L, 1);
+			lua_pushfstring(L, "error waiting for I/O: %s",
+					strerror(errno));
+			return LUA_ERRRUN;
+		}
+		lua_pushboolean(co, n > 0);
+		nargs = 1;
+	}
+
+	/* move the results or the error */
+	if (status == 0) {
+		if (nresults != LUA_MULTRET) {
+			lua_settop(co, nresults);
+		}
+		n = lua_gettop(co);
+		lua_xmove(co, L, n);
+		lua_remove(L, -(n + 1));
+	} else {
+		lua_xmove(co, L, 1);
+		push_traceback(L, co);
+		lua_remove(L, -2);
+	}
+
+	return status;
+}
+
+int lwt_apache_is_aborted (lua_State *L) {
+	lwt_request_rec *lr;
+
+	lr = get_lwt_request_rec(L);
+	return lr && is_aborted(lr);
+}
+
+int lwt_apache_is_bad_request (lua_State *L) {
+	lwt_request_rec *lr;
+
+	lr = get_lwt_request_rec(L);
+	return lr && lr->args_bad;
+}
+
 int luaopen_apache (lua_State *L) {
 	/* register module, functions and file handles */
 	#if LUA_VERSION_NUM >= 502
@@ -1637,6 +3863,27 @@ int luaopen_apache (lua_State *L) {
 	register_filehandles(L);
 	register_log(L);
 
+	/* register write and flush on the output file */
+	lua_getfield(L, -1, "output");
+	lua_pushcclosure(L, write_output, 1);
+	lua_setfield(L, -2, "write");
+	lua_getfield(L, -1, "output");
+	lua_pushcclosure(L, flush_output, 1);
+	lua_setfield(L, -2, "flush");
+	lua_getfield(L, -1, "output");
+	lua_pushcclosure(L, stream, 1);
+	lua_setfield(L, -2, "stream");
+
+	/* client abort error */
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWT_APACHE_ABORTED);
+	lua_setfield(L, -2, "aborted");
+
+	/* JSON null */
+	lua_pushlightuserdata(L, NULL);
+	lua_setfield(L, -2, "null");
+
 	/* create metatable for APR tables */
 	luaL_newmetatable(L, LWT_APACHE_APR_TABLE_METATABLE);
 	lua_pushcfunction(L, apr_table_index);
@@ -1649,6 +3896,38 @@ int luaopen_apache (lua_State *L) {
 	lua_setfield(L, -2, "__pairs");
 	lua_pop(L, 1);
 
+	/* create metatable for undecoded request arguments */
+	luaL_newmetatable(L, LWT_APACHE_ARGS_METATABLE);
+	lua_pushcfunction(L, args_index);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, args_newindex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushcfunction(L, args_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, args_pairs);
+	lua_setfield(L, -2, "__pairs");
+	lua_pop(L, 1);
+
+	/* create metatable for WSAPI outputs */
+	luaL_newmetatable(L, LWT_APACHE_WSAPI_OUTPUT_METATABLE);
+	lua_newtable(L);
+	lua_pushcfunction(L, wsapi_output_write);
+	lua_setfield(L, -2, "write");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* create metatable for streams */
+	luaL_newmetatable(L, LWT_APACHE_STREAM_METATABLE);
+	lua_newtable(L);
+	lua_pushcfunction(L, stream_write);
+	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, stream_send);
+	lua_setfield(L, -2, "send");
+	lua_pushcfunction(L, stream_sleep);
+	lua_setfield(L, -2, "sleep");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	/* create metatables for request rec */
 	luaL_newmetatable(L, LWT_APACHE_REQUEST_REC_METATABLE);
 	lua_pushcfunction(L, request_rec_index);
@@ -13,8 +13,13 @@
 #define LWT_APACHE_REQUEST_REC "lwt_request_rec"
 #define LWT_APACHE_DEFERRED "lwt_deferred"
 #define LWT_APACHE_ERR_DEFERRED "lwt_err_deferred"
+#define LWT_APACHE_COOKIES "lwt_cookies"
+#define LWT_APACHE_ABORTED "lwt_aborted"
 #define LWT_APACHE_REQUEST_REC_METATABLE "lwt_request_rec_metatable"
 #define LWT_APACHE_APR_TABLE_METATABLE "lwt_apr_table_metatable"
+#define LWT_APACHE_ARGS_METATABLE "lwt_args_metatable"
+#define LWT_APACHE_WSAPI_OUTPUT_METATABLE "lwt_wsapi_output_metatable"
+#define LWT_APACHE_STREAM_METATABLE "lwt_stream_metatable"
 
 /**
  * Initializes the Lua support.
@@ -33,6 +38,29 @@ void lwt_apache_init (apr_pool_t *pool);
 apr_status_t lwt_apache_set_module_path (lua_State *L, const char *path,
 		const char *cpath, request_rec *r);
 
+/**
+ * Loads a Lua file as a function. Compiled chunks are cached across requests
+ * and recompiled when the file changes.
+ *
+ * @param L the Lua state
+ * @param filename the filename
+ * @return a Lua load status code, as returned by luaL_loadfile
+ */
+int lwt_apache_loadfile (lua_State *L, const char *filename);
+
+/**
+ * Runs a function in a coroutine, like lua_pcall without a message handler.
+ * Yields of httpd.wait are served by polling the requested file descriptor
+ * and resuming the coroutine. In case of an error, string messages are
+ * extended with a traceback.
+ *
+ * @param L the Lua state
+ * @param nargs the number of arguments
+ * @param nresults the number of results, or LUA_MULTRET
+ * @return a Lua status code, as returned by lua_pcall
+ */
+int lwt_apache_run (lua_State *L, int nargs, int nresults);
+
 /**
  * Pushes the request record onto the Lua stack and also sets it in the Lua
  * registry.
@@ -44,7 +72,8 @@ apr_status_t lwt_apache_set_module_path (lua_State *L, const char *path,
 apr_status_t lwt_apache_push_request_rec (lua_State *L, request_rec *r);
 
 /**
- * Decodea and pushes the request arguments onto the Lua stack.
+ * Pushes the request arguments onto the Lua stack. The arguments are decoded,
+ * and the request body is read, when they are first accessed.
  *
  * @param L the Lua state
  * @param r the request record
@@ -82,6 +111,22 @@ apr_status_t lwt_apache_push_deferred (lua_State *L, int err);
  */
 int lwt_apache_is_abort (lua_State *L);
 
+/**
+ * Returns whether the client connection has been aborted.
+ *
+ * @param L the Lua state
+ * @return whether the client connection has been aborted
+ */
+int lwt_apache_is_aborted (lua_State *L);
+
+/**
+ * Returns whether decoding the request arguments has failed.
+ *
+ * @param L the Lua state
+ * @return whether decoding the request arguments has failed
+ */
+int lwt_apache_is_bad_request (lua_State *L);
+
 /**
  * Opens the Apache library in a Lua state.
  *
@@ -0,0 +1,240 @@
+/*
+ * Checks and benchmarks the mod_lwt escape span implementations. The table,
+ * SSE2 and AVX2 implementations are compared against a byte-wise reference,
+ * and their throughput is measured. Pass -c to run the check only. See LICENSE for license terms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "util.c"
+
+/*
+ * Benchmark parameters.
+ */
+#define BENCH_MAXLEN 128
+#define BENCH_SIZE (64 * 1024)
+#define BENCH_BYTES ((size_t) 1 << 28)
+
+/*
+ * Escape span implementation.
+ */
+typedef struct span_rec {
+	const char *name;
+	apr_size_t (*span) (int, const char *, apr_size_t);
+} span_rec;
+
+/*
+ * Escape kinds.
+ */
+static const struct {
+	const char *name;
+	int kind;
+} kinds[] = {
+	{ "uri", LWT_UTIL_ESCAPE_URI },
+	{ "xml", LWT_UTIL_ESCAPE_XML },
+	{ "js", LWT_UTIL_ESCAPE_JS },
+	{ "json", LWT_UTIL_ESCAPE_JSON }
+};
+
+#define KIND_CNT ((int) (sizeof(kinds) / sizeof(kinds[0])))
+
+/*
+ * Implementations available on this CPU.
+ */
+static span_rec spans[3];
+static int span_cnt = 0;
+
+/*
+ * Failure count.
+ */
+static int failures = 0;
+
+/*
+ * Returns the length of the initial run of characters not requiring escaping
+ * one byte at a time.
+ */
+static apr_size_t reference_span (int kind, const char *s, apr_size_t len) {
+	apr_size_t i;
+
+	for (i = 0; i < len && !(escape_classes[(unsigned char) s[i]] & kind);
+			i++);
+	return i;
+}
+
+/*
+ * Compares all implementations against the reference for a buffer.
+ */
+static void check_span (int k, const char *s, apr_size_t len) {
+	apr_size_t expected, actual;
+	int i;
+
+	expected = reference_span(kinds[k].kind, s, len);
+	for (i = 0; i < span_cnt; i++) {
+		actual = spans[i].span(kinds[k].kind, s, len);
+		if (actual != expected) {
+			if (failures++ < 20) {
+				fprintf(stderr, "FAIL %s %s: len %lu, expected "
+						"%lu, got %lu\n", spans[i].name,
+						kinds[k].name,
+						(unsigned long) len,
+						(unsigned long) expected,
+						(unsigned long) actual);
+			}
+		}
+	}
+}
+
+/*
+ * Checks the implementations. Every length and offset up to BENCH_MAXLEN is
+ * covered with each character at the last position, so the tails handled by
+ * the table are exercised, and with embedded zeros and random bytes. Each
+ * character is also placed at every position of a full-length buffer to
+ * exercise every lane of the vector blocks.
+ */
+static void check (void) {
+	char *buf, *s;
+	apr_size_t len, off, pos;
+	int k, c, rounds;
+
+	/* over-allocate to let the vector loads read past the tested span */
+	buf = (char *) malloc(BENCH_MAXLEN + 64);
+	for (k = 0; k < KIND_CNT; k++) {
+		for (off = 0; off < 32; off++) {
+			s = buf + off;
+			for (len = 0; len + off <= BENCH_MAXLEN; len++) {
+				/* no escape, and each character at the end */
+				memset(buf, 'a', BENCH_MAXLEN + 64);
+				check_span(k, s, len);
+				for (c = 0; c < 256 && len > 0; c++) {
+					s[len - 1] = (char) c;
+					check_span(k, s, len);
+				}
+
+				/* embedded zeros */
+				for (pos = 0; pos < len; pos += 3) {
+					s[pos] = '\0';
+				}
+				check_span(k, s, len);
+
+				/* random bytes */
+				for (rounds = 0; rounds < 8; rounds++) {
+					for (pos = 0; pos < len; pos++) {
+						if (rand() % (rounds + 2) == 0) {
+							s[pos] = (char) rand();
+						} else {
+							s[pos] = 'a' + rand() % 26;
+						}
+					}
+					check_span(k, s, len);
+				}
+			}
+
+			/* each character at each position */
+			len = BENCH_MAXLEN - off;
+			memset(buf, 'a', BENCH_MAXLEN + 64);
+			for (pos = 0; pos < len; pos++) {
+				for (c = 0; c < 256; c++) {
+					s[pos] = (char) c;
+					check_span(k, s, len);
+				}
+				s[pos] = 'a';
+			}
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Returns the current time in seconds.
+ */
+static double now (void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Measures the throughput of the implementations over a buffer, in MB/s. The
+ * buffer is scanned span by span, like the escape functions do.
+ */
+static void bench (const char *name, int k, const char *s, apr_size_t len) {
+	apr_size_t done, pos, sink;
+	double start, elapsed;
+	int i;
+
+	printf("%-5s %-8s", kinds[k].name, name);
+	for (i = 0; i < span_cnt; i++) {
+		sink = 0;
+		start = now();
+		for (done = 0; done < BENCH_BYTES; done += len) {
+			pos = spans[i].span(kinds[k].kind, s, len);
+			while (pos < len) {
+				pos++;
+				pos += spans[i].span(kinds[k].kind, s + pos,
+						len - pos);
+				sink++;
+			}
+		}
+		elapsed = now() - start;
+		printf(" %6s %8.0f MB/s", spans[i].name, BENCH_BYTES
+				/ elapsed / 1e6);
+		if (sink == (apr_size_t) -1) {
+			printf("!");
+		}
+	}
+	printf("\n");
+}
+
+/*
+ * Runs the benchmarks.
+ */
+static void benchmark (void) {
+	char *plain, *text;
+	apr_size_t i;
+	int k;
+
+	/* plain text without escapes, and markup with an escape every ~40 */
+	plain = (char *) malloc(BENCH_SIZE);
+	text = (char *) malloc(BENCH_SIZE);
+	for (i = 0; i < BENCH_SIZE; i++) {
+		plain[i] = 'a' + i % 26;
+		text[i] = i % 40 == 39 ? '"' : i % 7 == 6 ? ' ' : 'a' + i % 26;
+	}
+	for (k = 0; k < KIND_CNT; k++) {
+		bench("plain", k, plain, BENCH_SIZE);
+		bench("text", k, text, BENCH_SIZE);
+	}
+	free(plain);
+	free(text);
+}
+
+int main (int argc, char *argv[]) {
+	spans[span_cnt].name = "table";
+	spans[span_cnt++].span = escape_span_table;
+	#ifdef LWT_UTIL_SSE2
+	spans[span_cnt].name = "sse2";
+	spans[span_cnt++].span = escape_span_sse2;
+	#endif
+	#ifdef LWT_UTIL_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		spans[span_cnt].name = "avx2";
+		spans[span_cnt++].span = escape_span_avx2;
+	}
+	#endif
+
+	check();
+	if (failures > 0) {
+		fprintf(stderr, "%d failures\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("check passed (%d implementations)\n", span_cnt);
+	if (argc < 2 || strcmp(argv[1], "-c") != 0) {
+		benchmark();
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,731 @@
+/*
+ * Provides the mod_lwt JSON functions. See LICENSE for license terms.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <apr_strings.h>
+#include <lauxlib.h>
+#include "util.h"
+#include "json.h"
+
+/*
+ * Lua 5.3 integer compatibility.
+ */
+#if LUA_VERSION_NUM < 503
+#define lua_isinteger(L, i) 0
+#endif
+
+/*
+ * Maximum nesting depth of arrays and objects.
+ */
+#define JSON_MAX_DEPTH 128
+
+/*
+ * Maximum length of a number.
+ */
+#define JSON_MAX_NUMBER 64
+
+/*
+ * Largest magnitude up to which all whole numbers are exact doubles (2^53).
+ */
+#define JSON_MAX_EXACT 9007199254740992.0
+
+/*
+ * Decoding state.
+ */
+typedef struct json_decoder_t {
+	lua_State *L;
+	const char *s;
+	const char *pos;
+	const char *end;
+	apr_pool_t *pool;
+	const char *err;
+	int depth;
+} json_decoder_t;
+
+/*
+ * Encoding state.
+ */
+typedef struct json_encoder_t {
+	lua_State *L;
+	FILE *f;
+	apr_pool_t *pool;
+	const char *err;
+	int depth;
+} json_encoder_t;
+
+/*
+ * Sets a decoding error.
+ */
+static apr_status_t decode_error (json_decoder_t *d, const char *msg) {
+	d->err = apr_psprintf(d->pool, "%s at offset %lu", msg,
+			(unsigned long) (d->pos - d->s));
+	return APR_EGENERAL;
+}
+
+/*
+ * Skips whitespace.
+ */
+static void decode_whitespace (json_decoder_t *d) {
+	while (d->pos < d->end && (*d->pos == ' ' || *d->pos == '\t'
+			|| *d->pos == '\n' || *d->pos == '\r')) {
+		d->pos++;
+	}
+}
+
+/*
+ * Decodes four hex digits.
+ */
+static int decode_hex4 (const char *s, unsigned long *cp) {
+	int i;
+
+	*cp = 0;
+	for (i = 0; i < 4; i++) {
+		*cp <<= 4;
+		if (s[i] >= '0' && s[i] <= '9') {
+			*cp |= s[i] - '0';
+		} else if (s[i] >= 'a' && s[i] <= 'f') {
+			*cp |= s[i] - 'a' + 10;
+		} else if (s[i] >= 'A' && s[i] <= 'F') {
+			*cp |= s[i] - 'A' + 10;
+		} else {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Decodes a \u escape, including surrogate pairs, into UTF-8.
+ */
+static apr_status_t decode_unicode (json_decoder_t *d, luaL_Buffer *b) {
+	unsigned long cp, cp2;
+
+	if (d->end - d->pos < 5 || !decode_hex4(d->pos + 1, &cp)) {
+		return decode_error(d, "invalid unicode escape");
+	}
+	d->pos += 4;
+	if (cp >= 0xd800 && cp <= 0xdbff) {
+		if (d->end - d->pos < 7 || d->pos[1] != '\\'
+				|| d->pos[2] != 'u'
+				|| !decode_hex4(d->pos + 3, &cp2)
+				|| cp2 < 0xdc00 || cp2 > 0xdfff) {
+			return decode_error(d, "invalid surrogate pair");
+		}
+		cp = 0x10000 + ((cp - 0xd800) << 10) + (cp2 - 0xdc00);
+		d->pos += 6;
+	} else if (cp >= 0xdc00 && cp <= 0xdfff) {
+		return decode_error(d, "invalid surrogate pair");
+	}
+	if (cp < 0x80) {
+		luaL_addchar(b, (char) cp);
+	} else if (cp < 0x800) {
+		luaL_addchar(b, (char) (0xc0 | (cp >> 6)));
+		luaL_addchar(b, (char) (0x80 | (cp & 0x3f)));
+	} else if (cp < 0x10000) {
+		luaL_addchar(b, (char) (0xe0 | (cp >> 12)));
+		luaL_addchar(b, (char) (0x80 | ((cp >> 6) & 0x3f)));
+		luaL_addchar(b, (char) (0x80 | (cp & 0x3f)));
+	} else {
+		luaL_addchar(b, (char) (0xf0 | (cp >> 18)));
+		luaL_addchar(b, (char) (0x80 | ((cp >> 12) & 0x3f)));
+		luaL_addchar(b, (char) (0x80 | ((cp >> 6) & 0x3f)));
+		luaL_addchar(b, (char) (0x80 | (cp & 0x3f)));
+	}
+	return APR_SUCCESS;
+}
+
+/*
+ * Decodes a string. Strings without escapes are pushed directly from the
+ * JSON text.
+ */
+static apr_status_t decode_string (json_decoder_t *d) {
+	const char *mark;
+	luaL_Buffer b;
+	apr_status_t status;
+
+	/* scan up to the first quote, escape or control character */
+	d->pos++;
+	mark = d->pos;
+	d->pos += lwt_util_escape_span(LWT_UTIL_ESCAPE_JSON, d->pos,
+			d->end - d->pos);
+	if (d->pos < d->end && *d->pos == '"') {
+		lua_pushlstring(d->L, mark, d->pos - mark);
+		d->pos++;
+		return APR_SUCCESS;
+	}
+
+	/* decode escapes */
+	luaL_buffinit(d->L, &b);
+	luaL_addlstring(&b, mark, d->pos - mark);
+	while (1) {
+		if (d->pos == d->end) {
+			return decode_error(d, "unterminated string");
+		}
+		if (*d->pos == '"') {
+			break;
+		}
+		if ((unsigned char) *d->pos < 0x20) {
+			return decode_error(d, "control character in string");
+		}
+		if (*d->pos != '\\') {
+			mark = d->pos;
+			d->pos += lwt_util_escape_span(LWT_UTIL_ESCAPE_JSON,
+					d->pos, d->end - d->pos);
+			luaL_addlstring(&b, mark, d->pos - mark);
+			continue;
+		}
+		d->pos++;
+		if (d->pos == d->end) {
+			return decode_error(d, "unterminated string");
+		}
+		switch (*d->pos) {
+		case '"':
+		case '\\':
+		case '/':
+			luaL_addchar(&b, *d->pos);
+			break;
+
+		case 'b':
+			luaL_addchar(&b, '\b');
+			break;
+
+		case 'f':
+			luaL_addchar(&b, '\f');
+			break;
+
+		case 'n':
+			luaL_addchar(&b, '\n');
+			break;
+
+		case 'r':
+			luaL_addchar(&b, '\r');
+			break;
+
+		case 't':
+			luaL_addchar(&b, '\t');
+			break;
+
+		case 'u':
+			if ((status = decode_unicode(d, &b)) != APR_SUCCESS) {
+				return status;
+			}
+			break;
+
+		default:
+			return decode_error(d, "invalid escape");
+		}
+		d->pos++;
+	}
+	luaL_pushresult(&b);
+	d->pos++;
+
+	return APR_SUCCESS;
+}
+
+/*
+ * Decodes a number.
+ */
+static apr_status_t decode_number (json_decoder_t *d) {
+	const char *mark;
+	char buf[JSON_MAX_NUMBER];
+	int integer;
+	#if LUA_VERSION_NUM >= 503
+	long long ll;
+	#endif
+
+	/* validate */
+	mark = d->pos;
+	if (d->pos < d->end && *d->pos == '-') {
+		d->pos++;
+	}
+	if (d->pos < d->end && *d->pos == '0') {
+		d->pos++;
+	} else if (d->pos < d->end && *d->pos >= '1' && *d->pos <= '9') {
+		while (d->pos < d->end && *d->pos >= '0' && *d->pos <= '9') {
+			d->pos++;
+		}
+	} else {
+		return decode_error(d, "invalid number");
+	}
+	integer = 1;
+	if (d->pos < d->end && *d->pos == '.') {
+		integer = 0;
+		d->pos++;
+		if (d->pos == d->end || *d->pos < '0' || *d->pos > '9') {
+			return decode_error(d, "invalid number");
+		}
+		while (d->pos < d->end && *d->pos >= '0' && *d->pos <= '9') {
+			d->pos++;
+		}
+	}
+	if (d->pos < d->end && (*d->pos == 'e' || *d->pos == 'E')) {
+		integer = 0;
+		d->pos++;
+		if (d->pos < d->end && (*d->pos == '+' || *d->pos == '-')) {
+			d->pos++;
+		}
+		if (d->pos == d->end || *d->pos < '0' || *d->pos > '9') {
+			return decode_error(d, "invalid number");
+		}
+		while (d->pos < d->end && *d->pos >= '0' && *d->pos <= '9') {
+			d->pos++;
+		}
+	}
+
+	/* convert */
+	if (d->pos - mark >= JSON_MAX_NUMBER) {
+		return decode_error(d, "number too long");
+	}
+	memcpy(buf, mark, d->pos - mark);
+	buf[d->pos - mark] = '\0';
+	#if LUA_VERSION_NUM >= 503
+	if (integer) {
+		/* integers beyond the 64-bit range are decoded as numbers */
+		errno = 0;
+		ll = strtoll(buf, NULL, 10);
+		if (errno != ERANGE) {
+			lua_pushinteger(d->L, (lua_Integer) ll);
+			return APR_SUCCESS;
+		}
+	}
+	#else
+	(void) integer;
+	#endif
+	lua_pushnumber(d->L, (lua_Number) strtod(buf, NULL));
+
+	return APR_SUCCESS;
+}
+
+/*
+ * Decodes a literal.
+ */
+static apr_status_t decode_literal (json_decoder_t *d, const char *literal) {
+	size_t len;
+
+	len = strlen(literal);
+	if ((size_t) (d->end - d->pos) < len
+			|| memcmp(d->pos, literal, len) != 0) {
+		return decode_error(d, "invalid literal");
+	}
+	d->pos += len;
+	return APR_SUCCESS;
+}
+
+static apr_status_t decode_value (json_decoder_t *d);
+
+/*
+ * Decodes an array.
+ */
+static apr_status_t decode_array (json_decoder_t *d) {
+	int n;
+	apr_status_t status;
+
+	d->pos++;
+	lua_newtable(d->L);
+	decode_whitespace(d);
+	if (d->pos < d->end && *d->pos == ']') {
+		d->pos++;
+		return APR_SUCCESS;
+	}
+	n = 0;
+	while (1) {
+		if ((status = decode_value(d)) != APR_SUCCESS) {
+			return status;
+		}
+		lua_rawseti(d->L, -2, ++n);
+		decode_whitespace(d);
+		if (d->pos == d->end) {
+			return decode_error(d, "unterminated array");
+		}
+		if (*d->pos == ']') {
+			d->pos++;
+			return APR_SUCCESS;
+		}
+		if (*d->pos != ',') {
+			return decode_error(d, "expected ',' or ']'");
+		}
+		d->pos++;
+	}
+}
+
+/*
+ * Decodes an object.
+ */
+static apr_status_t decode_object (json_decoder_t *d) {
+	apr_status_t status;
+
+	d->pos++;
+	lua_newtable(d->L);
+	decode_whitespace(d);
+	if (d->pos < d->end && *d->pos == '}') {
+		d->pos++;
+		return APR_SUCCESS;
+	}
+	while (1) {
+		decode_whitespace(d);
+		if (d->pos == d->end || *d->pos != '"') {
+			return decode_error(d, "expected string");
+		}
+		if ((status = decode_string(d)) != APR_SUCCESS) {
+			return status;
+		}
+		decode_whitespace(d);
+		if (d->pos == d->end || *d->pos != ':') {
+			return decode_error(d, "expected ':'");
+		}
+		d->pos++;
+		if ((status = decode_value(d)) != APR_SUCCESS) {
+			return status;
+		}
+		lua_rawset(d->L, -3);
+		decode_whitespace(d);
+		if (d->pos == d->end) {
+			return decode_error(d, "unterminated object");
+		}
+		if (*d->pos == '}') {
+			d->pos++;
+			return APR_SUCCESS;
+		}
+		if (*d->pos != ',') {
+			return decode_error(d, "expected ',' or '}'");
+		}
+		d->pos++;
+	}
+}
+
+/*
+ * Decodes a value.
+ */
+static apr_status_t decode_value (json_decoder_t *d) {
+	apr_status_t status;
+
+	decode_whitespace(d);
+	if (d->pos == d->end) {
+		return decode_error(d, "unexpected end of input");
+	}
+	switch (*d->pos) {
+	case '{':
+	case '[':
+		if (++d->depth > JSON_MAX_DEPTH) {
+			return decode_error(d, "nesting too deep");
+		}
+		if (!lua_checkstack(d->L, 4)) {
+			return decode_error(d, "stack overflow");
+		}
+		status = *d->pos == '{' ? decode_object(d) : decode_array(d);
+		d->depth--;
+		return status;
+
+	case '"':
+		return decode_string(d);
+
+	case 't':
+		if ((status = decode_literal(d, "true")) == APR_SUCCESS) {
+			lua_pushboolean(d->L, 1);
+		}
+		return status;
+
+	case 'f':
+		if ((status = decode_literal(d, "false")) == APR_SUCCESS) {
+			lua_pushboolean(d->L, 0);
+		}
+		return status;
+
+	case 'n':
+		if ((status = decode_literal(d, "null")) == APR_SUCCESS) {
+			lua_pushlightuserdata(d->L, NULL);
+		}
+		return status;
+
+	default:
+		return decode_number(d);
+	}
+}
+
+/*
+ * Sets an encoding error.
+ */
+static apr_status_t encode_error (json_encoder_t *e, const char *msg) {
+	e->err = apr_pstrdup(e->pool, msg);
+	return APR_EGENERAL;
+}
+
+/*
+ * Checks the output for a write error, such as an aborted client connection.
+ */
+static apr_status_t encode_check (json_encoder_t *e) {
+	if (ferror(e->f)) {
+		e->err = apr_psprintf(e->pool, "error writing output: %s",
+				strerror(errno));
+		return APR_EGENERAL;
+	}
+	return APR_SUCCESS;
+}
+
+/*
+ * Encodes a string. Runs of characters without escapes are written as a
+ * whole.
+ */
+static void encode_string (json_encoder_t *e, const char *s, size_t len) {
+	size_t pos;
+	char buf[LWT_UTIL_ESCAPE_MAX];
+
+	putc('"', e->f);
+	pos = lwt_util_escape_span(LWT_UTIL_ESCAPE_JSON, s, len);
+	fwrite(s, 1, pos, e->f);
+	while (pos < len) {
+		fwrite(buf, 1, lwt_util_escape_char(LWT_UTIL_ESCAPE_JSON,
+				(unsigned char) s[pos], buf), e->f);
+		s += pos + 1;
+		len -= pos + 1;
+		pos = lwt_util_escape_span(LWT_UTIL_ESCAPE_JSON, s, len);
+		fwrite(s, 1, pos, e->f);
+	}
+	putc('"', e->f);
+}
+
+/*
+ * Encodes a number. Whole numbers within 2^53 in magnitude are written as
+ * integers; other numbers are written with the shortest precision that
+ * round-trips.
+ */
+static apr_status_t encode_number (json_encoder_t *e, lua_Number n) {
+	double d;
+	char buf[32];
+
+	/* n - n is NaN for infinities and NaN */
+	if (n - n != 0) {
+		return encode_error(e, "cannot encode non-finite number");
+	}
+	d = (double) n;
+	if (d >= -JSON_MAX_EXACT && d <= JSON_MAX_EXACT && d == (double)
+			(long long) d) {
+		fprintf(e->f, "%lld", (long long) d);
+		return APR_SUCCESS;
+	}
+	snprintf(buf, sizeof(buf), "%.15g", d);
+	if (strtod(buf, NULL) != d) {
+		snprintf(buf, sizeof(buf), "%.17g", d);
+	}
+	fputs(buf, e->f);
+	return APR_SUCCESS;
+}
+
+static apr_status_t encode_value (json_encoder_t *e, int index);
+
+/*
+ * Encodes a table as an array or object.
+ */
+static apr_status_t encode_table (json_encoder_t *e, int index) {
+	lua_State *L;
+	size_t n, max, i;
+	int array, first;
+	lua_Number k;
+	const char *key;
+	size_t len;
+	apr_status_t status;
+
+	L = e->L;
+	if (++e->depth > JSON_MAX_DEPTH) {
+		return encode_error(e, "nesting too deep");
+	}
+	if (!lua_checkstack(L, 4)) {
+		return encode_error(e, "stack overflow");
+	}
+
+	/* determine if the table is an array */
+	n = 0;
+	max = 0;
+	array = 1;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		n++;
+		if (array && lua_type(L, -2) == LUA_TNUMBER) {
+			k = lua_tonumber(L, -2);
+			if (k >= 1 && k <= INT_MAX
+					&& k == (lua_Number) (int) k) {
+				if ((size_t) k > max) {
+					max = (size_t) k;
+				}
+			} else {
+				array = 0;
+			}
+		} else {
+			array = 0;
+		}
+		lua_pop(L, 1);
+	}
+
+	if (n > 0 && array && max == n) {
+		/* array */
+		putc('[', e->f);
+		for (i = 1; i <= n; i++) {
+			if (i > 1) {
+				putc(',', e->f);
+			}
+			lua_rawgeti(L, index, (int) i);
+			if ((status = encode_value(e, lua_gettop(L)))
+					!= APR_SUCCESS
+					|| (status = encode_check(e))
+					!= APR_SUCCESS) {
+				return status;
+			}
+			lua_pop(L, 1);
+		}
+		putc(']', e->f);
+	} else {
+		/* object */
+		putc('{', e->f);
+		first = 1;
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			if (!first) {
+				putc(',', e->f);
+			}
+			first = 0;
+			switch (lua_type(L, -2)) {
+			case LUA_TSTRING:
+				key = lua_tolstring(L, -2, &len);
+				encode_string(e, key, len);
+				break;
+
+			case LUA_TNUMBER:
+				/* convert a copy to keep lua_next working */
+				lua_pushvalue(L, -2);
+				key = lua_tolstring(L, -1, &len);
+				encode_string(e, key, len);
+				lua_pop(L, 1);
+				break;
+
+			default:
+				return encode_error(e, apr_psprintf(e->pool,
+						"cannot encode key of type %s",
+						luaL_typename(L, -2)));
+			}
+			putc(':', e->f);
+			if ((status = encode_value(e, lua_gettop(L)))
+					!= APR_SUCCESS
+					|| (status = encode_check(e))
+					!= APR_SUCCESS) {
+				return status;
+			}
+			lua_pop(L, 1);
+		}
+		putc('}', e->f);
+	}
+	e->depth--;
+
+	return APR_SUCCESS;
+}
+
+/*
+ * Encodes a value.
+ */
+static apr_status_t encode_value (json_encoder_t *e, int index) {
+	const char *s;
+	size_t len;
+
+	switch (lua_type(e->L, index)) {
+	case LUA_TNIL:
+		fputs("null", e->f);
+		return APR_SUCCESS;
+
+	case LUA_TBOOLEAN:
+		fputs(lua_toboolean(e->L, index) ? "true" : "false", e->f);
+		return APR_SUCCESS;
+
+	case LUA_TNUMBER:
+		if (lua_isinteger(e->L, index)) {
+			fprintf(e->f, "%lld", (long long) lua_tointeger(e->L,
+					index));
+			return APR_SUCCESS;
+		}
+		return encode_number(e, lua_tonumber(e->L, index));
+
+	case LUA_TSTRING:
+		s = lua_tolstring(e->L, index, &len);
+		encode_string(e, s, len);
+		return APR_SUCCESS;
+
+	case LUA_TTABLE:
+		return encode_table(e, index);
+
+	case LUA_TLIGHTUSERDATA:
+		if (lua_touserdata(e->L, index) == NULL) {
+			fputs("null", e->f);
+			return APR_SUCCESS;
+		}
+		/* fall through */
+
+	default:
+		return encode_error(e, apr_psprintf(e->pool,
+				"cannot encode value of type %s",
+				luaL_typename(e->L, index)));
+	}
+}
+
+/*
+ * Exported functions.
+ */
+
+apr_status_t lwt_json_decode (lua_State *L, const char *s, apr_size_t len,
+		apr_pool_t *pool, const char **err) {
+	json_decoder_t d;
+	int top;
+	apr_status_t status;
+
+	d.L = L;
+	d.s = s;
+	d.pos = s;
+	d.end = s + len;
+	d.pool = pool;
+	d.err = NULL;
+	d.depth = 0;
+	top = lua_gettop(L);
+	if ((status = decode_value(&d)) == APR_SUCCESS) {
+		decode_whitespace(&d);
+		if (d.pos != d.end) {
+			status = decode_error(&d, "trailing characters");
+		}
+	}
+	if (status != APR_SUCCESS) {
+		lua_settop(L, top);
+		if (err) {
+			*err = d.err;
+		}
+	}
+
+	return status;
+}
+
+apr_status_t lwt_json_encode (lua_State *L, int index, FILE *f,
+		apr_pool_t *pool, const char **err) {
+	json_encoder_t e;
+	int top;
+	apr_status_t status;
+
+	e.L = L;
+	e.f = f;
+	e.pool = pool;
+	e.err = NULL;
+	e.depth = 0;
+	top = lua_gettop(L);
+	if (index < 0) {
+		index = top + 1 + index;
+	}
+	if ((status = encode_value(&e, index)) == APR_SUCCESS) {
+		status = encode_check(&e);
+	}
+	if (status != APR_SUCCESS) {
+		lua_settop(L, top);
+		if (err) {
+			*err = e.err;
+		}
+	}
+
+	return status;
+}
@@ -0,0 +1,43 @@
+/**
+ * Provides the mod_lwt JSON functions. See LICENSE for license terms.
+ */
+
+#ifndef MOD_LWT_JSON_INCLUDED
+#define MOD_LWT_JSON_INCLUDED
+
+#include <stdio.h>
+#include <apr_pools.h>
+#include <lua.h>
+
+/**
+ * Decodes a JSON text and pushes the resulting value onto the Lua stack.
+ * Objects and arrays are decoded to tables, and null is decoded to a light
+ * userdata with a NULL pointer.
+ *
+ * @param L the Lua state
+ * @param s the JSON text
+ * @param len the length of the JSON text
+ * @param pool a pool for allocations
+ * @param err is assigned the error message in case of an error (unless NULL)
+ * @return APR_SUCCESS if the JSON text is successfully decoded, and an error
+ * status otherwise
+ */
+apr_status_t lwt_json_decode (lua_State *L, const char *s, apr_size_t len,
+		apr_pool_t *pool, const char **err);
+
+/**
+ * Encodes a Lua value as JSON. Tables with consecutive positive integer keys
+ * starting at 1 are encoded as arrays, and other tables as objects.
+ *
+ * @param L the Lua state
+ * @param index the stack index of the value
+ * @param f the output file pointer
+ * @param pool a pool for allocations
+ * @param err is assigned the error message in case of an error (unless NULL)
+ * @return APR_SUCCESS if the value is successfully encoded, and an error
+ * status otherwise
+ */
+apr_status_t lwt_json_encode (lua_State *L, int index, FILE *f,
+		apr_pool_t *pool, const char **err);
+
+#endif /* MOD_LWT_JSON_INCLUDED */
@@ -503,7 +503,7 @@ static int loadfile (request_rec *r, lwt_conf_t *conf, lua_State *L,
 	const char *errormsg;
 
 	/* load chunk */
-	switch (luaL_loadfile(L, filename)) {
+	switch (lwt_apache_loadfile(L, filename)) {
 	case 0:
 		return OK;
 
@@ -536,7 +536,7 @@ static int loadfile (request_rec *r, lwt_conf_t *conf, lua_State *L,
 				filename, lua_errormsg(L));
 		return HTTP_INTERNAL_SERVER_ERROR;
 
-	#if LUA_VERSION_NUM >= 502
+	#if LUA_VERSION_NUM >= 502 && LUA_VERSION_NUM < 504
 	case LUA_ERRGCMM:
 		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
 				"Lua gc metamethod error loading '%s': %s",
@@ -581,7 +581,7 @@ static int dofile (request_rec *r, lwt_conf_t *conf, lua_State *L,
 	lua_pushvalue(L, 4);
 
 	/* run chunk */
-	switch (lua_pcall(L, conf->handler ? 3 : 2, 1, 1)) {
+	switch (lwt_apache_run(L, conf->handler ? 3 : 2, 1)) {
 	case 0:
 		if (lua_isnil(L, -1)) {
 			/* OK */
@@ -608,7 +608,19 @@ static int dofile (request_rec *r, lwt_conf_t *conf, lua_State *L,
 		}
 			
 	case LUA_ERRRUN:
+		if (lwt_apache_is_aborted(L)) {
+			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+					"Client aborted running '%s'",
+					filename);
+			return OK;
+		}
 		errormsg = lua_errormsg(L);
+		if (lwt_apache_is_bad_request(L)) {
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+					"Bad request running '%s': %s",
+					filename, errormsg);
+			return HTTP_BAD_REQUEST;
+		}
 		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
 				"Lua runtime error running '%s': %s",
 				filename, errormsg);
@@ -643,7 +655,7 @@ static int dofile (request_rec *r, lwt_conf_t *conf, lua_State *L,
 				filename, lua_errormsg(L));
 		return HTTP_INTERNAL_SERVER_ERROR;
 
-	#if LUA_VERSION_NUM >= 502
+	#if LUA_VERSION_NUM >= 502 && LUA_VERSION_NUM < 504
 	case LUA_ERRGCMM:
 		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
 				"Lua gc metamethod error running '%s': %s",
@@ -691,11 +703,17 @@ static int dowsapi (request_rec *r, lua_State *L, const char *filename) {
 	}
 
 	/* invoke */
-	switch (lua_pcall(L, 1, 0, 1)) {
+	switch (lwt_apache_run(L, 1, 0)) {
 	case 0:
 		return OK;
 
 	case LUA_ERRRUN:
+		if (lwt_apache_is_aborted(L)) {
+			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+					"Client aborted running '%s'",
+					filename);
+			return OK;
+		}
 		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, 
 				"Lua runtime error running '%s': %s",
 				filename, lua_errormsg(L));
@@ -713,7 +731,7 @@ static int dowsapi (request_rec *r, lua_State *L, const char *filename) {
 				filename, lua_errormsg(L));
 		return HTTP_INTERNAL_SERVER_ERROR;
 
-	#if LUA_VERSION_NUM >= 502
+	#if LUA_VERSION_NUM >= 502 && LUA_VERSION_NUM < 504
 	case LUA_ERRGCMM:
 		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, 
 				"Lua gc metamethod error running '%s': %s",
@@ -934,7 +952,7 @@ static int deferred (request_rec *r) {
 						lua_errormsg(L));
 				break;
 
-			#if LUA_VERSION_NUM >= 502
+			#if LUA_VERSION_NUM >= 502 && LUA_VERSION_NUM < 504
 			case LUA_ERRGCMM:
 				ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
 						"Lua GC metamethod error "
@@ -981,6 +999,7 @@ static int stat_log (request_rec *r) {
  * Initializes the LWT module.
  */
 static void init (apr_pool_t *pool) {
+	lwt_util_init();
 	lwt_apache_init(pool);
 	lwt_template_init(pool);
 	ap_hook_handler(handler, NULL, NULL, APR_HOOK_MIDDLE);
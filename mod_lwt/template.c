@@ -3,6 +3,8 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <string.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
 #include <http_protocol.h>
@@ -23,6 +25,9 @@ typedef struct parser_rec {
 	char *pos;
 	apr_array_header_t *t;
 	apr_array_header_t *b;
+	apr_array_header_t *names;
+	apr_array_header_t *raws;
+	apr_array_header_t *debug;
 	const char *err;
 } parser_rec;
 
@@ -31,7 +36,7 @@ typedef struct parser_rec {
  * Render record.
  */
 typedef struct render_rec {
-	apr_array_header_t *t;
+	lwt_template_t *t;
 	lua_State *L;
 	apr_pool_t *pool;
 	FILE *f;
@@ -42,49 +47,37 @@ typedef struct render_rec {
 } render_rec;
 
 /**
- * Template node.
+ * Template node. Nodes are small fixed-size instructions; names, raw
+ * segments and source text live in side tables of the template.
  */
 typedef struct template_node_t {
-        int type;
-        union {
-		struct {
-			int jump_next;
-		};
-                struct {
-                        const char *if_cond;
-			int if_index;
-                        int if_next;
-                };
-                struct {
-                        const char *for_init_in;
-			int for_init_index;
-		};
-		struct {
-                        apr_array_header_t *for_next_names;
-                        int for_next_next;
-                };
-		struct {
-			apr_array_header_t *set_names;
-			const char *set_expressions;
-			int set_index;
-		};
-		struct {
-			const char *include_filename;
-			int include_index;
-			const char *include_flags;
-		};
-                struct {
-                        char *sub_exp;
-			int sub_index;
-                        int sub_flags;
-                };
-                struct {
-                        const char *raw_str;
-                        size_t raw_len;
-                };
-        };
+	unsigned char type;
+	unsigned char cnt;
+	unsigned short flags;
+	int index;
+	int next;
+	int offset;
 } template_node_t;
 
+/*
+ * Raw template segment.
+ */
+typedef struct template_raw_t {
+	const char *str;
+	apr_size_t len;
+} template_raw_t;
+
+/*
+ * Prepared template.
+ */
+struct lwt_template_t {
+	template_node_t *nodes;
+	int nodes_cnt;
+	const char **names;
+	template_raw_t *raws;
+	const char **debug;
+};
+
 /*
  * Block.
  */
@@ -103,7 +96,10 @@ typedef struct block_t {
 } block_t;
 
 /*
- * Node types.
+ * Node types. A node uses its fields as follows: JUMP (next), IF (index,
+ * next), FOR_INIT (index), FOR_NEXT (offset and cnt of names, next), SET
+ * (index, offset and cnt of names), INCLUDE (index, offset of flags in
+ * names), SUB (index, flags) and RAW (index of raw segment).
  */
 #define TEMPLATE_TJUMP 1
 #define TEMPLATE_TIF 2
@@ -135,6 +131,7 @@ typedef struct block_t {
  * Limits.
  */
 #define TEMPLATE_MAX_DEPTH 8
+#define TEMPLATE_MAX_NAMES 255
 
 /*
  * Prototype for recusive includes.
@@ -191,6 +188,16 @@ static apr_status_t runtime_error (render_rec *d) {
 	return APR_EGENERAL;
 }
 
+/*
+ * Returns an output error.
+ */
+static apr_status_t output_error (render_rec *d) {
+	d->err = apr_psprintf(d->pool, "error writing output: %s",
+			strerror(errno));
+
+	return APR_EGENERAL;
+}
+
 /*
  * Parses a flags string.
  */
@@ -314,6 +321,59 @@ static apr_status_t evaluate_exp_str (render_rec *d, int index) {
 	return APR_SUCCESS;
 }
 		
+/*
+ * Appends a node with its source text for dumping.
+ */
+static template_node_t *push_node (parser_rec *p, int type,
+		const char *debug) {
+	template_node_t *n;
+
+	*((const char **) apr_array_push(p->debug)) = debug;
+	n = (template_node_t *) apr_array_push(p->t);
+	memset(n, 0, sizeof(template_node_t));
+	n->type = type;
+	n->next = -1;
+
+	return n;
+}
+
+/*
+ * Returns a node by index.
+ */
+static template_node_t *get_node (parser_rec *p, int index) {
+	return ((template_node_t *) p->t->elts) + index;
+}
+
+/*
+ * Parses a names attribute into the names table.
+ */
+static apr_status_t parse_names (parser_rec *p, apr_table_t *attrs,
+		template_node_t *n) {
+	const char *names;
+	char *name, *last;
+	const char *sep = ", \t";
+
+	names = apr_table_get(attrs, "names");
+	if (names == NULL) {
+		return parse_error(p, "missing attribute 'names'");
+	}
+	n->offset = p->names->nelts;
+	name = apr_strtok(apr_pstrdup(p->pool, names), sep, &last);
+	while (name != NULL) {
+		if (p->names->nelts - n->offset == TEMPLATE_MAX_NAMES) {
+			return parse_error(p, "too many 'names'");
+		}
+		*((const char **) apr_array_push(p->names)) = name;
+		name = apr_strtok(NULL, sep, &last);
+	}
+	n->cnt = p->names->nelts - n->offset;
+	if (n->cnt == 0) {
+		return parse_error(p, "empty 'names'");
+	}
+
+	return APR_SUCCESS;
+}
+
 /*
  * Element processor type.
  */
@@ -327,6 +387,7 @@ static apr_status_t process_if (parser_rec *p, const char *element,
 		int states, apr_table_t *attrs) {
 	block_t *block;
 	template_node_t *n;
+	const char *cond;
 	apr_status_t status;
 
 	if ((states & TEMPLATE_SOPEN) != 0) {
@@ -336,17 +397,15 @@ static apr_status_t process_if (parser_rec *p, const char *element,
 		block->if_last = p->t->nelts;
 		block->if_cnt = 0;
 
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TIF;
-		n->if_cond = apr_table_get(attrs, "cond");
-		if (n->if_cond == NULL) {
+		cond = apr_table_get(attrs, "cond");
+		n = push_node(p, TEMPLATE_TIF, cond);
+		if (cond == NULL) {
 			return parse_error(p, "missing attribute 'cond'");
 		}
-		if ((status = compile_exp(p, n->if_cond, &n->if_index))
+		if ((status = compile_exp(p, cond, &n->index))
 				!= APR_SUCCESS) {
 			return status;
 		}
-		n->if_next = -1;
 	}	
 
 	if ((states & TEMPLATE_SCLOSE) != 0) {
@@ -356,14 +415,14 @@ static apr_status_t process_if (parser_rec *p, const char *element,
 		}
 
 		if (block->if_last != -1) {
-			n = ((template_node_t *) p->t->elts) + block->if_last;
-			n->if_next = p->t->nelts;
+			n = get_node(p, block->if_last);
+			n->next = p->t->nelts;
 		}
 
-		n = ((template_node_t *) p->t->elts) + block->if_start;
+		n = get_node(p, block->if_start);
 		while (block->if_cnt > 0) {
-			n = ((template_node_t *) p->t->elts) + n->if_next;
-			(n - 1)->jump_next = p->t->nelts;
+			n = get_node(p, n->next);
+			(n - 1)->next = p->t->nelts;
 			block->if_cnt--;
 		}
 	}
@@ -378,6 +437,7 @@ static apr_status_t process_elseif (parser_rec *p, const char *element,
 		int states, apr_table_t *attrs) {
 	block_t *block;
 	template_node_t *n;
+	const char *cond;
 	apr_status_t status;
 
 	if ((states & TEMPLATE_SOPEN) != 0) {
@@ -389,26 +449,22 @@ static apr_status_t process_elseif (parser_rec *p, const char *element,
 			return parse_error(p, "no 'if' to continue");
 		}
 
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TJUMP;
-		n->jump_next = -1;
+		push_node(p, TEMPLATE_TJUMP, NULL);
 		block->if_cnt++;
 
-		n = ((template_node_t *) p->t->elts) + block->if_last;
-		n->if_next = p->t->nelts;
+		n = get_node(p, block->if_last);
+		n->next = p->t->nelts;
 		block->if_last = p->t->nelts;
 
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TIF;
-		n->if_cond = apr_table_get(attrs, "cond");
-		if (n->if_cond == NULL) {
+		cond = apr_table_get(attrs, "cond");
+		n = push_node(p, TEMPLATE_TIF, cond);
+		if (cond == NULL) {
 			return parse_error(p, "missing attribute 'cond'");
 		}
-		if ((status = compile_exp(p, n->if_cond, &n->if_index))
+		if ((status = compile_exp(p, cond, &n->index))
 				!= APR_SUCCESS) {
 			return status;
 		}
-		n->if_next = -1;
 	}
 
 	return APR_SUCCESS;
@@ -431,13 +487,11 @@ static apr_status_t process_else (parser_rec *p, const char *element,
 			return parse_error(p, "no 'if' to continue");
 		}
 
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TJUMP;
-		n->jump_next = -1;
+		push_node(p, TEMPLATE_TJUMP, NULL);
 		block->if_cnt++;
 
-		n = ((template_node_t *) p->t->elts) + block->if_last;
-		n->if_next = p->t->nelts;
+		n = get_node(p, block->if_last);
+		n->next = p->t->nelts;
 		block->if_last = -1;
 	}
 
@@ -451,20 +505,16 @@ static apr_status_t process_for (parser_rec *p, const char *element,
 		int states, apr_table_t *attrs) {
 	template_node_t *n;
 	block_t *block;
+	const char *in;
 	apr_status_t status;
-	const char *names;
-	char *name, *last;
-	const char *sep = ", \t";
 
 	if ((states & TEMPLATE_SOPEN) != 0) {
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TFOR_INIT;
-		n->for_init_in = apr_table_get(attrs, "in");
-		if (n->for_init_in == NULL) {
+		in = apr_table_get(attrs, "in");
+		n = push_node(p, TEMPLATE_TFOR_INIT, in);
+		if (in == NULL) {
 			return parse_error(p, "missing attribute 'in'");
 		}
-		if ((status = compile_exp(p, n->for_init_in,
-				&n->for_init_index)) != APR_SUCCESS) {
+		if ((status = compile_exp(p, in, &n->index)) != APR_SUCCESS) {
 			return status;
 		}
 
@@ -472,23 +522,10 @@ static apr_status_t process_for (parser_rec *p, const char *element,
 		block->type = TEMPLATE_TFOR_NEXT;
 		block->for_start = p->t->nelts;
 
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TFOR_NEXT;
-		n->for_next_names = apr_array_make(p->pool, 2,
-				sizeof(const char *));
-		names = apr_table_get(attrs, "names");
-		if (names == NULL) {
-			return parse_error(p, "missing attribute 'names'");
-		}
-		name = apr_strtok(apr_pstrdup(p->pool, names), sep, &last);
-		while (name != NULL) {
-			*((char **) apr_array_push(n->for_next_names)) = name;	
-			name = apr_strtok(NULL, sep, &last);
-		}
-		if (n->for_next_names->nelts == 0) {
-			return parse_error(p, "empty 'names'");
+		n = push_node(p, TEMPLATE_TFOR_NEXT, NULL);
+		if ((status = parse_names(p, attrs, n)) != APR_SUCCESS) {
+			return status;
 		}
-		n->for_next_next = -1;
 	}
 
 	if ((states & TEMPLATE_SCLOSE) != 0) {
@@ -497,12 +534,11 @@ static apr_status_t process_for (parser_rec *p, const char *element,
                         return parse_error(p, "no 'for' to close");
 		}
 
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TJUMP;
-		n->jump_next = block->for_start;
+		n = push_node(p, TEMPLATE_TJUMP, NULL);
+		n->next = block->for_start;
 
-                n = ((template_node_t *) p->t->elts) + block->for_start;
-                n->for_next_next = p->t->nelts;
+                n = get_node(p, block->for_start);
+                n->next = p->t->nelts;
         }
 
 	return APR_SUCCESS;
@@ -514,33 +550,20 @@ static apr_status_t process_for (parser_rec *p, const char *element,
 static apr_status_t process_set (parser_rec *p, const char *element,
 		int states, apr_table_t *attrs) {
         template_node_t *n;
-	const char *names;
-        char *name, *last;
-        const char *sep = ", \t";
+	const char *expressions;
         int status;
 
         if ((states & TEMPLATE_SOPEN) != 0) {
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TSET;
-                n->set_names = apr_array_make(p->pool, 2, sizeof(const char *));
-                names = apr_table_get(attrs, "names");
-                if (names == NULL) {
-                        return parse_error(p, "missing attribute 'names'");
-                }
-                name = apr_strtok(apr_pstrdup(p->pool, names), sep, &last);
-                while (name != NULL) {
-                        *((char **) apr_array_push(n->set_names)) = name;
-                        name = apr_strtok(NULL, sep, &last);
-                }
-                if (apr_is_empty_array(n->set_names)) {
-                        return parse_error(p, "empty 'names'");
-                }
-                n->set_expressions = apr_table_get(attrs, "expressions");
-                if (n->set_expressions == NULL) {
+                expressions = apr_table_get(attrs, "expressions");
+		n = push_node(p, TEMPLATE_TSET, expressions);
+		if ((status = parse_names(p, attrs, n)) != APR_SUCCESS) {
+			return status;
+		}
+                if (expressions == NULL) {
                         return parse_error(p, "missing attribute "
 					"'expressions'");
                 }
-                if ((status = compile_exp(p, n->set_expressions, &n->set_index))
+                if ((status = compile_exp(p, expressions, &n->index))
 				!= APR_SUCCESS) {
                         return status;
                 }
@@ -555,20 +578,22 @@ static apr_status_t process_set (parser_rec *p, const char *element,
 static apr_status_t process_include (parser_rec *p, const char *element,
 		int states, apr_table_t *attrs) {
 	template_node_t *n;
+	const char *filename;
 	int status;
 
 	if ((states & TEMPLATE_SOPEN) != 0) {
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TINCLUDE;
-		n->include_filename = apr_table_get(attrs, "filename");
-		if (n->include_filename == NULL) {
+		filename = apr_table_get(attrs, "filename");
+		n = push_node(p, TEMPLATE_TINCLUDE, filename);
+		if (filename == NULL) {
 			return parse_error(p, "missing attribute 'filename'");
 		}
-		if ((status = compile_exp(p, n->include_filename,
-				&n->include_index)) != APR_SUCCESS) {
+		if ((status = compile_exp(p, filename, &n->index))
+				!= APR_SUCCESS) {
 			return status;
 		}
-		n->include_flags = apr_table_get(attrs, "flags");
+		n->offset = p->names->nelts;
+		*((const char **) apr_array_push(p->names)) = apr_table_get(
+				attrs, "flags");
 	}
 
 	return APR_SUCCESS;
@@ -700,10 +725,10 @@ static apr_status_t parse_element (parser_rec *p) {
 static apr_status_t parse_sub (parser_rec *p) {
 	template_node_t *n;
 	int braces, quot;
+	char *exp;
 	apr_status_t status;
 	
-	n = (template_node_t *) apr_array_push(p->t);
-	n->type = TEMPLATE_TSUB;
+	n = push_node(p, TEMPLATE_TSUB, NULL);
 	p->pos++;
 
 	/* optional flags */
@@ -716,11 +741,11 @@ static apr_status_t parse_sub (parser_rec *p) {
 		if (*p->pos != ']') {
 			return parse_error(p, "']' expected");
 		}
-		n->sub_flags = parse_flags(apr_pstrndup(p->pool, p->begin,
+		n->flags = parse_flags(apr_pstrndup(p->pool, p->begin,
 				p->pos - p->begin));
 		p->pos++;
 	} else {
-		n->sub_flags = p->flags;
+		n->flags = p->flags;
 	}
 
 	/* expression */
@@ -791,10 +816,10 @@ static apr_status_t parse_sub (parser_rec *p) {
 	if (braces > 0) {
 		return parse_error(p, "'}' expected");
 	}
-	n->sub_exp = apr_pstrndup(p->pool, p->begin, p->pos - p->begin - 1);
-	unescape_xml(n->sub_exp);
-	if ((status = compile_exp(p, n->sub_exp, &n->sub_index))
-			!= APR_SUCCESS) {
+	exp = apr_pstrndup(p->pool, p->begin, p->pos - p->begin - 1);
+	unescape_xml(exp);
+	((const char **) p->debug->elts)[p->debug->nelts - 1] = exp;
+	if ((status = compile_exp(p, exp, &n->index)) != APR_SUCCESS) {
 		return status;
 	}
 
@@ -806,12 +831,14 @@ static apr_status_t parse_sub (parser_rec *p) {
  */
 static void parse_raw (parser_rec *p) {
 	template_node_t *n;
+	template_raw_t *raw;
 
 	if (p->pos != p->begin) {
-		n = (template_node_t *) apr_array_push(p->t);
-		n->type = TEMPLATE_TRAW;
-		n->raw_str = p->begin;
-		n->raw_len = p->pos - p->begin;
+		n = push_node(p, TEMPLATE_TRAW, NULL);
+		n->index = p->raws->nelts;
+		raw = (template_raw_t *) apr_array_push(p->raws);
+		raw->str = p->begin;
+		raw->len = p->pos - p->begin;
 	}
 }
 
@@ -930,10 +957,11 @@ static apr_status_t parse_template (parser_rec *p) {
  */
 static apr_status_t render_template (render_rec *d) {
         int i, cnt;
+	lwt_template_t *t;
         template_node_t *n;
         apr_status_t status;
 	const char *str;
-	apr_array_header_t *t_save;
+	template_raw_t *raw;
 
 	d->depth++;
 	if (d->depth > TEMPLATE_MAX_DEPTH) {
@@ -942,29 +970,30 @@ static apr_status_t render_template (render_rec *d) {
 		return APR_EGENERAL;
 	}
 
+	t = d->t;
 	i = 0;
-	while (i < d->t->nelts) {
-		n = ((template_node_t *) d->t->elts) + i;
+	while (i < t->nodes_cnt) {
+		n = &t->nodes[i];
 		switch (n->type) {
 		case TEMPLATE_TJUMP:
-			i = n->jump_next;
+			i = n->next;
 			break;
 
 		case TEMPLATE_TIF:
-			if ((status = evaluate_exp(d, n->if_index, 1))
+			if ((status = evaluate_exp(d, n->index, 1))
 					!= APR_SUCCESS) {
 				return status;
 			} 
 			if (lua_toboolean(d->L, -1)) {
 				i++;
 			} else {
-				i = n->if_next;
+				i = n->next;
 			}
 			lua_pop(d->L, 1);
 			break;
 
 		case TEMPLATE_TFOR_INIT:
-			if ((status = evaluate_exp(d, n->for_init_index, 3))
+			if ((status = evaluate_exp(d, n->index, 3))
 					!= APR_SUCCESS) {
 				return status;
 			}
@@ -975,53 +1004,50 @@ static apr_status_t render_template (render_rec *d) {
 			lua_pushvalue(d->L, -3);
 			lua_pushvalue(d->L, -3);
 			lua_pushvalue(d->L, -3);
-			cnt = n->for_next_names->nelts;
+			cnt = n->cnt;
 			if (lua_pcall(d->L, 2, cnt, d->errfunc) != 0) {
 				return runtime_error(d);
 			}
 			if (lua_isnil(d->L, -cnt)) {
 				lua_pop(d->L, 3 + cnt);
-				i = n->for_next_next;
+				i = n->next;
 			} else {
 				lua_pushvalue(d->L, -cnt);
 				lua_replace(d->L, -1 - cnt - 1);
 				while (cnt > 0) {
 					cnt--;
-					lua_setglobal(d->L, ((const char **)
-							n->for_next_names
-							->elts)[cnt]);
+					lua_setglobal(d->L, t->names[n->offset
+							+ cnt]);
 				}
 				i++;
 			}
 			break;
 
 		case TEMPLATE_TSET:
-			cnt = n->set_names->nelts;
-			if ((status = evaluate_exp(d, n->set_index, cnt))
+			cnt = n->cnt;
+			if ((status = evaluate_exp(d, n->index, cnt))
 					!= APR_SUCCESS) {
 				return status;
 			}
 			while (cnt > 0) {
 				cnt--;
-				lua_setglobal(d->L, ((const char **)
-						n->set_names->elts)[cnt]);
+				lua_setglobal(d->L, t->names[n->offset + cnt]);
 			}
 			i++;
 			break;
  
 		case TEMPLATE_TINCLUDE:
-			if ((status = evaluate_exp_str(d, n->include_index))
+			if ((status = evaluate_exp_str(d, n->index))
 					!= APR_SUCCESS) {
 				return status;
 			}
 			str = lua_tostring(d->L, -1);
 			lua_pop(d->L, 1);
-			t_save = d->t;
-			d->t = (apr_array_header_t *) apr_hash_get(d->templates,
+			d->t = (lwt_template_t *) apr_hash_get(d->templates,
 					str, strlen(str));
 			if (d->t == NULL) {
 				if ((status = lwt_template_parse(str, d->L,
-						n->include_flags, d->pool,
+						t->names[n->offset], d->pool,
 						&d->t, &d->err))
 						!= APR_SUCCESS) {
 					return status;
@@ -1032,17 +1058,17 @@ static apr_status_t render_template (render_rec *d) {
 			if ((status = render_template(d)) != APR_SUCCESS) {
 				return status;
 			}
-			d->t = t_save;
+			d->t = t;
 			i++;
 			break;			
 
 		case TEMPLATE_TSUB:
-			lua_rawgeti(d->L, LUA_REGISTRYINDEX, n->sub_index);
+			lua_rawgeti(d->L, LUA_REGISTRYINDEX, n->index);
 			switch (lua_pcall(d->L, 0, 1, d->errfunc)) {
 			case 0:
 				if (lua_isstring(d->L, -1)) {
 					str = lua_tostring(d->L, -1);
-				} else if (lua_isnil(d->L, -1) && (n->sub_flags
+				} else if (lua_isnil(d->L, -1) && (n->flags
 						& TEMPLATE_FSUPNIL)) {
 					str = "";
 				} else {
@@ -1053,7 +1079,7 @@ static apr_status_t render_template (render_rec *d) {
 				break;
 
 			case LUA_ERRRUN:
-				if (n->sub_flags & TEMPLATE_FSUPERR) {
+				if (n->flags & TEMPLATE_FSUPERR) {
 					str = "";
 				} else {
 					return runtime_error(d);
@@ -1064,21 +1090,27 @@ static apr_status_t render_template (render_rec *d) {
 				return runtime_error(d);
 			}
 			lua_pop(d->L, 1);
-			if (n->sub_flags & TEMPLATE_FESCURL) {
+			if (n->flags & TEMPLATE_FESCURL) {
 				str = lwt_util_escape_uri(d->pool, str);
 			}
-			if (n->sub_flags & TEMPLATE_FESCXML) {
-				str = ap_escape_html(d->pool, str);
+			if (n->flags & TEMPLATE_FESCXML) {
+				str = lwt_util_escape_xml(d->pool, str);
 			}
-			if (n->sub_flags & TEMPLATE_FESCJS) {
+			if (n->flags & TEMPLATE_FESCJS) {
 				str = lwt_util_escape_js(d->pool, str);
 			}
-			fputs(str, d->f);
+			if (fputs(str, d->f) == EOF || ferror(d->f)) {
+				return output_error(d);
+			}
 			i++;
 			break;
 
 		case TEMPLATE_TRAW:
-			fwrite(n->raw_str, n->raw_len, 1, d->f);
+			raw = &t->raws[n->index];
+			if ((raw->len > 0 && fwrite(raw->str, raw->len, 1,
+					d->f) != 1) || ferror(d->f)) {
+				return output_error(d);
+			}
 			i++;
 			break;
 		}
@@ -1098,9 +1130,10 @@ void lwt_template_init (apr_pool_t *pool) {
 }
 
 apr_status_t lwt_template_parse (const char *filename, lua_State *L,
-		const char *flags, apr_pool_t *pool, apr_array_header_t **t,
+		const char *flags, apr_pool_t *pool, lwt_template_t **t,
 		const char **err) {
 	parser_rec *p;
+	lwt_template_t *template;
 	apr_status_t status;
 
 	p = (parser_rec *) apr_pcalloc(pool, sizeof(parser_rec));	
@@ -1110,6 +1143,9 @@ apr_status_t lwt_template_parse (const char *filename, lua_State *L,
 	p->pool = pool;
 	p->t = apr_array_make(pool, 32, sizeof(template_node_t));
 	p->b = apr_array_make(pool, 8, sizeof(block_t));	
+	p->names = apr_array_make(pool, 8, sizeof(const char *));
+	p->raws = apr_array_make(pool, 16, sizeof(template_raw_t));
+	p->debug = apr_array_make(pool, 32, sizeof(const char *));
 	status = parse_template(p);
 	if (status == APR_SUCCESS) {
 		if (!apr_is_empty_array(p->b)) {
@@ -1126,13 +1162,23 @@ apr_status_t lwt_template_parse (const char *filename, lua_State *L,
 	}
 
 	if (t != NULL) {
-		*t = p->t;
+		/* pack the nodes into a block of their exact size */
+		template = (lwt_template_t *) apr_palloc(pool,
+				sizeof(lwt_template_t));
+		template->nodes_cnt = p->t->nelts;
+		template->nodes = (template_node_t *) apr_pmemdup(pool,
+				p->t->elts, p->t->nelts
+				* sizeof(template_node_t));
+		template->names = (const char **) p->names->elts;
+		template->raws = (template_raw_t *) p->raws->elts;
+		template->debug = (const char **) p->debug->elts;
+		*t = template;
 	}
 
 	return APR_SUCCESS;
 } 
 
-apr_status_t lwt_template_render (apr_array_header_t *t, lua_State *L,
+apr_status_t lwt_template_render (lwt_template_t *t, lua_State *L,
 		apr_pool_t *pool, FILE *f, const char **err) {
 	render_rec *d;
 	apr_status_t status;
@@ -1157,53 +1203,51 @@ apr_status_t lwt_template_render (apr_array_header_t *t, lua_State *L,
 	return APR_SUCCESS;
 }
 
-apr_status_t lwt_template_dump (apr_array_header_t *t, lua_State *L, FILE *f,
+apr_status_t lwt_template_dump (lwt_template_t *t, lua_State *L, FILE *f,
 		const char **err) {
 	int i;
 	template_node_t *n;
+	const char *debug;
 
 	fputs("<ol start=\"0\">\r\n", f);
-	for (i = 0; i < t->nelts; i++) {
+	for (i = 0; i < t->nodes_cnt; i++) {
 		fputs("<li>", f);
-		n = ((template_node_t *) t->elts) + i;
+		n = &t->nodes[i];
+		debug = t->debug[i];
 		switch (n->type) {
 		case TEMPLATE_TJUMP:
-			fprintf(f, "JUMP next=%d", n->jump_next);
+			fprintf(f, "JUMP next=%d", n->next);
 			break;
 
 		case TEMPLATE_TIF:
-			fprintf(f, "IF cond=%s next=%d", n->if_cond,
-				n->if_next);
+			fprintf(f, "IF cond=%s next=%d", debug, n->next);
 			break;
 
 		case TEMPLATE_TFOR_INIT:
-			fprintf(f, "FOR_INIT in=%s", n->for_init_in);
+			fprintf(f, "FOR_INIT in=%s", debug);
 			break;
 
 		case TEMPLATE_TFOR_NEXT:
-			fprintf(f, "FOR_NEXT names=#%d next=%d",
-					n->for_next_names->nelts,
-					n->for_next_next);
+			fprintf(f, "FOR_NEXT names=#%d next=%d", n->cnt,
+					n->next);
 			break;
 
 		case TEMPLATE_TSET:
-			fprintf(f, "SET names=#%d expressions=%s",
-					n->set_names->nelts,
-					n->set_expressions);
+			fprintf(f, "SET names=#%d expressions=%s", n->cnt,
+					debug);
 			break;
 
 		case TEMPLATE_TINCLUDE:
-			fprintf(f, "INCLUDE filename=%s flags=%s",
-					n->include_filename, n->include_flags);
+			fprintf(f, "INCLUDE filename=%s flags=%s", debug,
+					t->names[n->offset]);
 			break;
 
 		case TEMPLATE_TSUB:
-			fprintf(f, "SUB exp=%s flags=%d", n->sub_exp,
-					n->sub_flags);
+			fprintf(f, "SUB exp=%s flags=%d", debug, n->flags);
 			break;
 
 		case TEMPLATE_TRAW:
-			fprintf(f, "RAW len=%zd", n->raw_len);
+			fprintf(f, "RAW len=%zd", t->raws[n->index].len);
 			break;
 		}
 		fputs("</li>\r\n", f);
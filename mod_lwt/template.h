@@ -9,6 +9,11 @@
 #include <httpd.h>
 #include <lua.h>
 
+/**
+ * Prepared template.
+ */
+typedef struct lwt_template_t lwt_template_t;
+
 /**
  * Initializes the template processing.
  *
@@ -29,7 +34,7 @@ void lwt_template_init (apr_pool_t *pool);
  * status otherwise
  */
 apr_status_t lwt_template_parse (const char *filename, lua_State *L,
-		const char *flags, apr_pool_t *pool, apr_array_header_t **t,
+		const char *flags, apr_pool_t *pool, lwt_template_t **t,
 		const char **err);
 
 /**
@@ -43,7 +48,7 @@ apr_status_t lwt_template_parse (const char *filename, lua_State *L,
  * @return APR_SUCCESS if the template is successfully rendered, and an error
  * status otherwise
  */
-apr_status_t lwt_template_render (apr_array_header_t *t, lua_State *L,
+apr_status_t lwt_template_render (lwt_template_t *t, lua_State *L,
 		apr_pool_t *pool, FILE *f, const char **err);
 
 /**
@@ -56,7 +61,7 @@ apr_status_t lwt_template_render (apr_array_header_t *t, lua_State *L,
  * @return APR_SUCCESS if the template is successfully dumped, and an error
  * status otherwise
  */
-apr_status_t lwt_template_dump (apr_array_header_t *t, lua_State *L, FILE *f,
+apr_status_t lwt_template_dump (lwt_template_t *t, lua_State *L, FILE *f,
 		const char **err);
 
 #endif /* MOD_LWT_TEMPLATE_INCLUDED */
@@ -3,12 +3,62 @@
  */
 
 #include <time.h>
-#include <ctype.h>
+#include <string.h>
 #include <apr_time.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include "util.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define LWT_UTIL_SSE2
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) \
+		|| (defined(__GNUC__) && __GNUC__ >= 5))
+#include <immintrin.h>
+#define LWT_UTIL_AVX2
+#endif
+
+/*
+ * Escape classes of characters. Each bit denotes an escape kind requiring the
+ * character to be escaped.
+ */
+static const unsigned char escape_classes[256] = {
+	0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09,
+	0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x09, 0x09,
+	0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09,
+	0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09,
+	0x01, 0x01, 0x0f, 0x01, 0x01, 0x01, 0x03, 0x05,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x01, 0x01, 0x03, 0x01, 0x03, 0x01,
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x01, 0x0d, 0x01, 0x01, 0x00,
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x00, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01
+};
+
 /*
  * Hexadecimal digits for URIs.
  */
@@ -16,124 +66,333 @@ static const char uri_hexdigits[] = { '0', '1', '2', '3', '4', '5', '6', '7',
 		'8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
 
 /*
- * Exported functions.
+ * Lowercase hexadecimal digits for JSON.
  */
+static const char json_hexdigits[] = "0123456789abcdef";
 
-const char *lwt_util_escape_uri (apr_pool_t *pool, const char *s) {
-	size_t cnt, esc_cnt, ps, pn;
-	char *n;
-	
-	/* count reserved and unsafe characters */
-	cnt = 0;
-	esc_cnt = 0;
-	while (s[cnt] != '\0') {
-		/* RFC 3986 */
-		if (!isalnum(s[cnt]) && s[cnt] != '-' && s[cnt] != '.'
-				&& s[cnt] != '_' && s[cnt] != '~') {
-			/* reserved */
-			esc_cnt++;
+/*
+ * Returns the length of the initial run of characters not requiring escaping
+ * using table lookups.
+ */
+static apr_size_t escape_span_table (int kind, const char *s, apr_size_t len) {
+	apr_size_t i;
+
+	i = 0;
+	while (i + 4 <= len) {
+		if (escape_classes[(unsigned char) s[i]] & kind) {
+			return i;
+		}
+		if (escape_classes[(unsigned char) s[i + 1]] & kind) {
+			return i + 1;
 		}
-		cnt++;
+		if (escape_classes[(unsigned char) s[i + 2]] & kind) {
+			return i + 2;
+		}
+		if (escape_classes[(unsigned char) s[i + 3]] & kind) {
+			return i + 3;
+		}
+		i += 4;
+	}
+	while (i < len && !(escape_classes[(unsigned char) s[i]] & kind)) {
+		i++;
 	}
+	return i;
+}
 
-	/* make escaped string */
-	n = (char *) apr_palloc(pool, cnt + esc_cnt * 2 + 1);
-	pn = 0;
-	for (ps = 0; ps < cnt; ps++) {
-		if (isalnum(s[ps]) || s[ps] == '-' || s[ps] == '.'
-				|| s[ps] == '_' || s[ps] == '~') {
-			n[pn++] = s[ps];
-		} else {
-			n[pn++] = '%';
-			n[pn++] = uri_hexdigits[((unsigned char) s[ps]) / 16]; 
-			n[pn++] = uri_hexdigits[((unsigned char) s[ps]) % 16];
+#ifdef LWT_UTIL_SSE2
+/*
+ * Returns a mask of the bytes in a range. Both bounds must be less than 0x80.
+ */
+static __m128i sse2_range (__m128i v, char lo, char hi) {
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+			_mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+/*
+ * Returns a mask of the bytes equal to a character.
+ */
+static __m128i sse2_eq (__m128i v, char c) {
+	return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+
+/*
+ * Returns the length of the initial run of characters not requiring escaping
+ * using SSE2 to skip 16-byte blocks.
+ */
+static apr_size_t escape_span_sse2 (int kind, const char *s, apr_size_t len) {
+	apr_size_t i;
+	__m128i v, m;
+	int bits;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (s + i));
+		switch (kind) {
+		case LWT_UTIL_ESCAPE_URI:
+			m = _mm_or_si128(_mm_or_si128(sse2_range(v, '0', '9'),
+					sse2_range(v, 'A', 'Z')),
+					_mm_or_si128(sse2_range(v, 'a', 'z'),
+					_mm_or_si128(_mm_or_si128(sse2_eq(v, '-'),
+					sse2_eq(v, '.')), _mm_or_si128(
+					sse2_eq(v, '_'), sse2_eq(v, '~')))));
+			bits = _mm_movemask_epi8(m) ^ 0xffff;
+			break;
+
+		case LWT_UTIL_ESCAPE_XML:
+			m = _mm_or_si128(_mm_or_si128(sse2_eq(v, '<'),
+					sse2_eq(v, '>')), _mm_or_si128(
+					sse2_eq(v, '&'), sse2_eq(v, '"')));
+			bits = _mm_movemask_epi8(m);
+			break;
+
+		case LWT_UTIL_ESCAPE_JS:
+			m = _mm_or_si128(_mm_or_si128(sse2_range(v, '\b', '\r'),
+					sse2_eq(v, '"')), _mm_or_si128(
+					sse2_eq(v, '\''), sse2_eq(v, '\\')));
+			bits = _mm_movemask_epi8(m);
+			break;
+
+		default:
+			m = _mm_or_si128(sse2_range(v, 0x00, 0x1f),
+					_mm_or_si128(sse2_eq(v, '"'),
+					sse2_eq(v, '\\')));
+			bits = _mm_movemask_epi8(m);
+			break;
+		}
+		if (bits != 0) {
+			return i + __builtin_ctz(bits);
 		}
 	}
-	n[pn] = '\0';
+	return i + escape_span_table(kind, s + i, len - i);
+}
+#endif
 
-	return n;
+#ifdef LWT_UTIL_AVX2
+/*
+ * Returns a mask of the bytes in a range. Both bounds must be less than 0x80.
+ */
+__attribute__((target("avx2")))
+static __m256i avx2_range (__m256i v, char lo, char hi) {
+	return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
 }
 
-const char *lwt_util_escape_js (apr_pool_t *pool, const char *s) {
-	size_t cnt, esc_cnt, ps, pn;
-	char *n;
-	
-	/* count reserved and unsafe characters */
-	cnt = 0;
-	esc_cnt = 0;
-	while (s[cnt] != '\0') {
-		switch (s[cnt]) {
-			case '\b':
-			case '\t':
-			case '\n':
-			case '\v':
-			case '\f':
-			case '\r':
-			case '\"':
-			case '\'':
-			case '\\':
-				esc_cnt++;
+/*
+ * Returns a mask of the bytes equal to a character.
+ */
+__attribute__((target("avx2")))
+static __m256i avx2_eq (__m256i v, char c) {
+	return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+}
+
+/*
+ * Returns the length of the initial run of characters not requiring escaping
+ * using AVX2 to skip 32-byte blocks.
+ */
+__attribute__((target("avx2")))
+static apr_size_t escape_span_avx2 (int kind, const char *s, apr_size_t len) {
+	apr_size_t i;
+	__m256i v, m;
+	unsigned int bits;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (s + i));
+		switch (kind) {
+		case LWT_UTIL_ESCAPE_URI:
+			m = _mm256_or_si256(_mm256_or_si256(
+					avx2_range(v, '0', '9'),
+					avx2_range(v, 'A', 'Z')),
+					_mm256_or_si256(avx2_range(v, 'a', 'z'),
+					_mm256_or_si256(_mm256_or_si256(
+					avx2_eq(v, '-'), avx2_eq(v, '.')),
+					_mm256_or_si256(avx2_eq(v, '_'),
+					avx2_eq(v, '~')))));
+			bits = ~(unsigned int) _mm256_movemask_epi8(m);
+			break;
+
+		case LWT_UTIL_ESCAPE_XML:
+			m = _mm256_or_si256(_mm256_or_si256(avx2_eq(v, '<'),
+					avx2_eq(v, '>')), _mm256_or_si256(
+					avx2_eq(v, '&'), avx2_eq(v, '"')));
+			bits = (unsigned int) _mm256_movemask_epi8(m);
+			break;
+
+		case LWT_UTIL_ESCAPE_JS:
+			m = _mm256_or_si256(_mm256_or_si256(
+					avx2_range(v, '\b', '\r'),
+					avx2_eq(v, '"')), _mm256_or_si256(
+					avx2_eq(v, '\''), avx2_eq(v, '\\')));
+			bits = (unsigned int) _mm256_movemask_epi8(m);
+			break;
+
+		default:
+			m = _mm256_or_si256(avx2_range(v, 0x00, 0x1f),
+					_mm256_or_si256(avx2_eq(v, '"'),
+					avx2_eq(v, '\\')));
+			bits = (unsigned int) _mm256_movemask_epi8(m);
+			break;
+		}
+		if (bits != 0) {
+			return i + __builtin_ctz(bits);
 		}
-		cnt++;
+	}
+	return i + escape_span_table(kind, s + i, len - i);
+}
+#endif
+
+/*
+ * Escape span implementation selected for the CPU.
+ */
+#ifdef LWT_UTIL_SSE2
+static apr_size_t (*escape_span) (int, const char *, apr_size_t)
+		= escape_span_sse2;
+#else
+static apr_size_t (*escape_span) (int, const char *, apr_size_t)
+		= escape_span_table;
+#endif
+
+/*
+ * Escapes a string in a pool. The string itself is returned if no character
+ * needs escaping.
+ */
+static const char *escape_pool (apr_pool_t *pool, int kind, const char *s) {
+	apr_size_t len, pos, n, esc_len;
+	char buf[LWT_UTIL_ESCAPE_MAX], *e, *p;
+
+	/* measure */
+	len = strlen(s);
+	pos = escape_span(kind, s, len);
+	if (pos == len) {
+		return s;
+	}
+	esc_len = len;
+	while (pos < len) {
+		esc_len += lwt_util_escape_char(kind, (unsigned char) s[pos],
+				buf) - 1;
+		pos++;
+		pos += escape_span(kind, s + pos, len - pos);
 	}
 
 	/* make escaped string */
-	n = (char *) apr_palloc(pool, cnt + esc_cnt + 1);
-	pn = 0;
-	for (ps = 0; ps < cnt; ps++) {
-		switch (s[ps]) {
-			case '\b':
-				n[pn++] = '\\';
-				n[pn++] = 'b';
-				break;
-
-			case '\t':
-				n[pn++] = '\\';
-				n[pn++] = 't';
-				break;
-
-			case '\n':
-				n[pn++] = '\\';
-				n[pn++] = 'n';
-				break;
-
-			case '\v':
-				n[pn++] = '\\';
-				n[pn++] = 'v';
-				break;
-
-			case '\f':
-				n[pn++] = '\\';
-				n[pn++] = 'f';
-				break;
-
-			case '\r':
-				n[pn++] = '\\';
-				n[pn++] = 'r';
-				break;
-
-			case '\"':
-				n[pn++] = '\\';
-				n[pn++] = '\"';
-				break;
-
-			case '\'':
-				n[pn++] = '\\';
-				n[pn++] = '\'';
-				break;
-
-			case '\\':
-				n[pn++] = '\\';
-				n[pn++] = '\\';
-				break;
-
-			default:
-				n[pn++] = s[ps];
+	e = (char *) apr_palloc(pool, esc_len + 1);
+	p = e;
+	pos = 0;
+	while (pos < len) {
+		n = escape_span(kind, s + pos, len - pos);
+		memcpy(p, s + pos, n);
+		p += n;
+		pos += n;
+		if (pos < len) {
+			p += lwt_util_escape_char(kind, (unsigned char) s[pos], p);
+			pos++;
+		}
+	}
+	*p = '\0';
+
+	return e;
+}
+
+/*
+ * Exported functions.
+ */
+
+void lwt_util_init (void) {
+	#ifdef LWT_UTIL_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		escape_span = escape_span_avx2;
+	}
+	#endif
+}
+
+apr_size_t lwt_util_escape_span (int kind, const char *s, apr_size_t len) {
+	return escape_span(kind, s, len);
+}
+
+int lwt_util_escape_char (int kind, unsigned char c, char *buf) {
+	switch (kind) {
+	case LWT_UTIL_ESCAPE_URI:
+		/* RFC 3986 */
+		buf[0] = '%';
+		buf[1] = uri_hexdigits[c >> 4];
+		buf[2] = uri_hexdigits[c & 0xf];
+		return 3;
+
+	case LWT_UTIL_ESCAPE_XML:
+		switch (c) {
+		case '<':
+			memcpy(buf, "&lt;", 4);
+			return 4;
+
+		case '>':
+			memcpy(buf, "&gt;", 4);
+			return 4;
+
+		case '&':
+			memcpy(buf, "&amp;", 5);
+			return 5;
+
+		default:
+			memcpy(buf, "&quot;", 6);
+			return 6;
 		}
+
+	default:
+		buf[0] = '\\';
+		switch (c) {
+		case '\b':
+			buf[1] = 'b';
+			return 2;
+
+		case '\t':
+			buf[1] = 't';
+			return 2;
+
+		case '\n':
+			buf[1] = 'n';
+			return 2;
+
+		case '\f':
+			buf[1] = 'f';
+			return 2;
+
+		case '\r':
+			buf[1] = 'r';
+			return 2;
+
+		case '\v':
+			if (kind == LWT_UTIL_ESCAPE_JS) {
+				buf[1] = 'v';
+				return 2;
+			}
+			break;
+
+		case '"':
+		case '\'':
+		case '\\':
+			buf[1] = c;
+			return 2;
+		}
+
+		/* JSON control character */
+		buf[1] = 'u';
+		buf[2] = '0';
+		buf[3] = '0';
+		buf[4] = json_hexdigits[c >> 4];
+		buf[5] = json_hexdigits[c & 0xf];
+		return 6;
 	}
-	n[pn] = '\0';
+}
 
-	return n;
+const char *lwt_util_escape_uri (apr_pool_t *pool, const char *s) {
+	return escape_pool(pool, LWT_UTIL_ESCAPE_URI, s);
+}
+
+const char *lwt_util_escape_xml (apr_pool_t *pool, const char *s) {
+	return escape_pool(pool, LWT_UTIL_ESCAPE_XML, s);
+}
+
+const char *lwt_util_escape_js (apr_pool_t *pool, const char *s) {
+	return escape_pool(pool, LWT_UTIL_ESCAPE_JS, s);
 }
 
 int lwt_util_traceback (lua_State *L) {
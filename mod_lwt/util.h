@@ -8,23 +8,72 @@
 #include <apr_pools.h>
 #include <lua.h>
 
+/**
+ * Escape kinds.
+ */
+#define LWT_UTIL_ESCAPE_URI 1
+#define LWT_UTIL_ESCAPE_XML 2
+#define LWT_UTIL_ESCAPE_JS 4
+#define LWT_UTIL_ESCAPE_JSON 8
+
+/**
+ * Maximum length of the escape sequence of a character.
+ */
+#define LWT_UTIL_ESCAPE_MAX 6
+
+/**
+ * Initializes the utility functions, selecting the escape implementation
+ * for the CPU.
+ */
+void lwt_util_init (void);
+
+/**
+ * Returns the length of the initial run of characters that need no escaping.
+ *
+ * @param kind the escape kind
+ * @param s the string
+ * @param len the length of the string
+ * @return the length of the run
+ */
+apr_size_t lwt_util_escape_span (int kind, const char *s, apr_size_t len);
+
+/**
+ * Escapes a character that needs escaping.
+ *
+ * @param kind the escape kind
+ * @param c the character
+ * @param buf receives the escape sequence; must hold LWT_UTIL_ESCAPE_MAX
+ * characters
+ * @return the length of the escape sequence
+ */
+int lwt_util_escape_char (int kind, unsigned char c, char *buf);
+
 /**
  * Escapes an URI.
  *
  * @param pool the memory pool
  * @param s the URI to escape
- * @return the escaped URI
+ * @return the escaped URI, or s if nothing needs escaping
+ */
+const char *lwt_util_escape_uri (apr_pool_t *pool, const char *s);
+
+/**
+ * Escapes XML reserved characters.
+ *
+ * @param pool the memory pool
+ * @param s the string to escape
+ * @return the escaped string, or s if nothing needs escaping
  */
-const char *lwt_util_escape_uri(apr_pool_t *pool, const char *s);
+const char *lwt_util_escape_xml (apr_pool_t *pool, const char *s);
 
 /**
  * Escapes a JavaScript string literal.
  *
  * @param pool the memory pool
  * @param s the JavaScript string literal to escape
- * @return the escaped URI
+ * @return the escaped string literal, or s if nothing needs escaping
  */
-const char *lwt_util_escape_js(apr_pool_t *pool, const char *s);
+const char *lwt_util_escape_js (apr_pool_t *pool, const char *s);
 
 /**
  * Lua function providing stack traceback.
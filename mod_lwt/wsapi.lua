@@ -1,8 +1,18 @@
 require "httpd"
 require "wsapi.common"
+local core = require("httpd.core")
 
 module(..., package.seeall)
 
+-- Loads Lua files through the compiled chunk cache
+local lua_loadfile = loadfile
+local function cached_loadfile (filename, ...)
+	if filename and select("#", ...) == 0 then
+		return core.loadfile(filename)
+	end
+	return lua_loadfile(filename, ...)
+end
+
 -- Loads an runs a WSAPI script
 local function do_wsapi (wsapi_env)
 	local path, file, modname = wsapi.common.find_module(wsapi_env,
@@ -12,7 +22,15 @@ local function do_wsapi (wsapi_env)
 				wsapi_env.SCRIPT_NAME) })
 	end
 	wsapi.app_path = path
-	local app = wsapi.common.load_wsapi(path, file, modname, "lua")
+	-- route loadfile through the cache only while loading the script
+	local saved_loadfile = _G.loadfile
+	_G.loadfile = cached_loadfile
+	local ok, app = pcall(wsapi.common.load_wsapi, path, file, modname,
+			"lua")
+	_G.loadfile = saved_loadfile
+	if not ok then
+		error(app, 0)
+	end
 	wsapi_env.APP_PATH = path
 	return app(wsapi_env)
 end
@@ -26,40 +44,9 @@ local function concat (...)
 	return table.concat(parts)
 end
 
--- Adds a header
-local function add_header (name, value)
-	local lower_name = string.lower(name)
-	if lower_name == "status" then
-		httpd.set_status(tonumber(string.match(value, "^%d+")))
-	elseif lower_name == "content-type" then
-		httpd.set_content_type(value)
-	else
-		httpd.add_header(name, value)
-	end
-	return ""
-end
-
 -- Run a request via WSAPI
 function run (request)
-	local output, header = { }, true
-	function output:write (...)
-		if header then
-			local s = concat(...)
-			if output.remainder then s = output.remainder .. s end
-			s = string.gsub(s, "([%w%-]+):%s+([^\r\n]*)\r\n",
-					add_header)
-			if string.sub(s, 1, 2) == "\r\n" then
-				header = false
-				httpd.write(string.sub(s, 3))
-			elseif #s == 0 then
-				output.remainder = nil
-			else
-				output.remainder = s
-			end
-		else
-			httpd.write(...)
-		end
-	end
+	local output = core.wsapi_output()
 
 	local err = { }
 	function err:write (...)